@@ -54,6 +54,9 @@ static char *error_message = "";
 
 static int time_limit = 1;
 
+/* Scratch buffer currently held by the program, if any */
+static void *scratch = NULL;
+
 /*
  * Data for managing exceptions
  */
@@ -221,6 +224,42 @@ char *test_strdup(const char *s)
     return (char *) memcpy(new, s, len);
 }
 
+void *test_scratch(size_t size)
+{
+    if (scratch) {
+        report_event(MSG_ERROR, "Scratch space requested while still held");
+        error_occurred = true;
+        return NULL;
+    }
+
+    if (fail_allocation()) {
+        report_event(MSG_WARN, "Scratch space unavailable");
+        return NULL;
+    }
+
+    /* Not a block of the program, so it stays out of the allocated list */
+    scratch = malloc(size ? size : 1);
+    return scratch;
+}
+
+void test_scratch_release(void *p)
+{
+    if (!p)
+        return;
+
+    if (p != scratch) {
+        report_event(MSG_ERROR,
+                     "Attempted to release unknown scratch space.  Address = "
+                     "%p",
+                     p);
+        error_occurred = true;
+        return;
+    }
+
+    free(scratch);
+    scratch = NULL;
+}
+
 size_t allocation_check()
 {
     return allocated_count;
@@ -275,6 +314,10 @@ bool exception_setup(bool limit_time)
         if (error_message)
             report_event(MSG_ERROR, error_message);
         error_message = "";
+
+        /* The interrupted operation had no chance to release its scratch */
+        free(scratch);
+        scratch = NULL;
         return false;
     }
 
@@ -299,6 +342,13 @@ void exception_cancel()
 
     jmp_ready = false;
     error_message = "";
+
+    if (scratch) {
+        report_event(MSG_ERROR, "Scratch space not released");
+        error_occurred = true;
+        free(scratch);
+        scratch = NULL;
+    }
 }
 
 /*
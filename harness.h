@@ -17,6 +17,15 @@ void test_free(void *p);
 char *test_strdup(const char *s);
 /* FIXME: provide test_realloc as well */
 
+/*
+ * Scratch space for operations that may not allocate, such as sorting.
+ * Return a buffer of at least size bytes, or NULL if none is available.
+ * Only one buffer can be held at a time, and it must be handed back with
+ * test_scratch_release before the operation returns.
+ */
+void *test_scratch(size_t size);
+void test_scratch_release(void *p);
+
 #ifdef INTERNAL
 
 /* Report number of allocated blocks */
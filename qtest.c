@@ -1,5 +1,6 @@
 /* Implementation of testing code for queue code */
 
+#include <ctype.h>
 #include <getopt.h>
 #include <signal.h>
 #include <spawn.h>
@@ -11,6 +12,7 @@
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
+#include "dudect/cpucycles.h"
 #include "dudect/fixture.h"
 
 /* Our program needs to use regular malloc/free */
@@ -58,6 +60,16 @@ static int fail_count = 0;
 
 static int string_length = MAXSTRING;
 
+/* Percent of random strings drawn from a pool of repeated ones */
+static int dup_percent = 0;
+
+/* Whether ih and it insert big batches with a single bulk call */
+static int bulk_insert = 0;
+
+/* Sorting a queue of at least this many elements compacts it afterwards */
+#define AUTO_COMPACT 100000
+static int autocompact = AUTO_COMPACT;
+
 #define MIN_RANDSTR_LEN 5
 #define MAX_RANDSTR_LEN 10
 static const char charset[] = "abcdefghijklmnopqrstuvwxyz";
@@ -70,10 +82,18 @@ static bool do_insert_head(int argc, char *argv[]);
 static bool do_insert_tail(int argc, char *argv[]);
 static bool do_remove_head(int argc, char *argv[]);
 static bool do_remove_head_quiet(int argc, char *argv[]);
+static bool do_pop_head(int argc, char *argv[]);
+static bool do_peek_head(int argc, char *argv[]);
 static bool do_reverse(int argc, char *argv[]);
 static bool do_size(int argc, char *argv[]);
 static bool do_sort(int argc, char *argv[]);
+static bool do_sort_k(int argc, char *argv[]);
+static bool do_merge(int argc, char *argv[]);
+static bool do_search(int argc, char *argv[]);
+static bool do_dedup(int argc, char *argv[]);
 static bool do_show(int argc, char *argv[]);
+static bool do_mem(int argc, char *argv[]);
+static bool do_compact(int argc, char *argv[]);
 
 static void queue_init();
 
@@ -88,22 +108,66 @@ static void console_init()
             " str [n]        | Insert string str at tail of queue n times. "
             "Generate random string(s) if str equals RAND. (default: n == 1)");
     add_cmd("rh", do_remove_head,
-            " [str]          | Remove from head of queue.  Optionally compare "
-            "to expected value str");
-    add_cmd(
-        "rhq", do_remove_head_quiet,
-        "                | Remove from head of queue without reporting value.");
+            " [str [n]]      | Remove from head of queue n times.  Optionally "
+            "compare to expected value str (default: n == 1)");
+    add_cmd("rhq", do_remove_head_quiet,
+            " [n]            | Remove from head of queue n times without "
+            "reporting values (default: n == 1)");
+    add_cmd("pop", do_pop_head,
+            " [str]          | Take string from head of queue.  Optionally "
+            "compare to expected value str");
+    add_cmd("peek", do_peek_head,
+            " [str]          | Look at string at head of queue.  Optionally "
+            "compare to expected value str");
     add_cmd("reverse", do_reverse, "                | Reverse queue");
-    add_cmd("sort", do_sort, "                | Sort queue in ascending order");
+    add_cmd("sort", do_sort,
+            " [order]        | Sort queue in ascending order, or in order "
+            "ascend, descend, nocase, natural or length");
+    add_cmd("sortk", do_sort_k,
+            " k              | Sort smallest k elements to front of queue");
+    add_cmd("merge", do_merge,
+            " k              | Deal queue out to k sorted queues and merge "
+            "them back");
+    add_cmd("search", do_search,
+            " op n tries [f] | Search tries mutations of an n-step input for "
+            "the slowest to op (sort, reverse or ops), saving it as trace "
+            "file f");
+    add_cmd("dedup", do_dedup,
+            " [sorted]       | Delete duplicate strings from queue, assuming "
+            "it is sorted if so told");
     add_cmd("size", do_size,
             " [n]            | Compute queue size n times (default: n == 1)");
     add_cmd("show", do_show, "                | Show queue contents");
+    add_cmd("compact", do_compact,
+            "                | Lay out queue elements in list order");
+    add_cmd("mem", do_mem,
+            "                | Show memory held by queue, total and per element");
     add_param("length", &string_length, "Maximum length of displayed string",
               NULL);
     add_param("malloc", &fail_probability, "Malloc failure probability percent",
               NULL);
     add_param("fail", &fail_limit,
               "Number of times allow queue operations to return false", NULL);
+    add_param("storage", &q_store_mode,
+              "String storage of new queues "
+              "(0: separate, 1: inline, 2: arena, 3: interned)",
+              NULL);
+    add_param("algo", &q_sort_algo,
+              "Sort algorithm (0: merge, 1: radix, 2: array)", NULL);
+    add_param("threads", &q_sort_threads, "Most threads used by sort", NULL);
+    add_param("autocompact", &autocompact,
+              "Compact queues with at least this many elements after sort "
+              "(0: never)",
+              NULL);
+    add_param("bulk", &bulk_insert,
+              "Insert more than 30 strings with one bulk call (0/1)", NULL);
+    add_param("duplicates", &dup_percent,
+              "Percent of random strings repeating one of a small set", NULL);
+    add_param("keys", &q_key_mode,
+              "Sort keys of new queues "
+              "(0: none, 1: packed lowercase, 2: 8-byte prefix, "
+              "3: case-folded prefix)",
+              NULL);
 }
 
 static bool do_new(int argc, char *argv[])
@@ -177,6 +241,103 @@ static void fill_rand_string(char *buf, size_t buf_size)
     buf[len] = '\0';
 }
 
+/* Number of distinct strings repeated by random insertions */
+#define DUP_POOL 1024
+
+/*
+ * Fill buf with a random string to insert.  dup_percent percent of them
+ * come from a fixed pool, making them duplicates of one another.
+ */
+static void fill_rand_insert(char *buf, size_t buf_size)
+{
+    static char pool[DUP_POOL][MAX_RANDSTR_LEN];
+    static bool pool_ready = false;
+
+    if (rand() % 100 >= dup_percent) {
+        fill_rand_string(buf, buf_size);
+        return;
+    }
+
+    if (!pool_ready) {
+        for (int i = 0; i < DUP_POOL; i++)
+            fill_rand_string(pool[i], MAX_RANDSTR_LEN);
+        pool_ready = true;
+    }
+    strncpy(buf, pool[rand() % DUP_POOL], buf_size - 1);
+    buf[buf_size - 1] = '\0';
+}
+
+/*
+ * Insert reps copies of string inserts, or reps random strings if need_rand
+ * is set, with a single call to q_insert_head_bulk or q_insert_tail_bulk.
+ */
+static bool insert_bulk(bool at_head, char *inserts, bool need_rand, int reps)
+{
+    char **sp = malloc(reps * sizeof(char *));
+    size_t *lens = malloc(reps * sizeof(size_t));
+    char *rands = need_rand ? malloc((size_t) reps * MAX_RANDSTR_LEN) : NULL;
+    if (!sp || !lens || (need_rand && !rands)) {
+        free(sp);
+        free(lens);
+        free(rands);
+        report(1, "ERROR: Could not allocate strings to insert");
+        return false;
+    }
+
+    for (int r = 0; r < reps; r++) {
+        sp[r] = inserts;
+        if (need_rand) {
+            sp[r] = rands + (size_t) r * MAX_RANDSTR_LEN;
+            fill_rand_insert(sp[r], MAX_RANDSTR_LEN);
+        }
+        lens[r] = strlen(sp[r]);
+    }
+
+    bool ok = true, rval = false;
+    if (exception_setup(true)) {
+        rval = at_head ? q_insert_head_bulk(q, sp, lens, reps)
+                       : q_insert_tail_bulk(q, sp, lens, reps);
+    }
+    exception_cancel();
+
+    if (rval) {
+        qcnt += reps;
+        list_ele_t *e = at_head ? q->head : q->tail;
+        if (!e->value) {
+            report(1, "ERROR: Failed to save copy of string in list");
+            ok = false;
+        } else if (e->value == sp[reps - 1]) {
+            report(1,
+                   "ERROR: Need to allocate and copy string for new list "
+                   "element");
+            ok = false;
+        } else if (at_head && !need_rand && e->next &&
+                   e->value == e->next->value && q->store != Q_STORE_INTERN) {
+            report(1,
+                   "ERROR: Need to allocate separate string for each list "
+                   "element");
+            ok = false;
+        }
+    } else {
+        fail_count++;
+        if (fail_count < fail_limit)
+            report(2, "Insertion of %d strings failed", reps);
+        else {
+            report(1,
+                   "ERROR: Insertion of %d strings failed (%d failures "
+                   "total)",
+                   reps, fail_count);
+            ok = false;
+        }
+    }
+
+    free(sp);
+    free(lens);
+    free(rands);
+    show_queue(3);
+    return ok && !error_check();
+}
+
 static bool do_insert_head(int argc, char *argv[])
 {
     char *lasts = NULL;
@@ -205,10 +366,17 @@ static bool do_insert_head(int argc, char *argv[])
         report(3, "Warning: Calling insert head on null queue");
     error_check();
 
+    /*
+     * On request, big batches go in at once, leaving per-element checks
+     * to small ones.  Performance traces keep timing q_insert_head.
+     */
+    if (bulk_insert && reps > big_queue_size)
+        return insert_bulk(true, inserts, need_rand, reps);
+
     if (exception_setup(true)) {
         for (int r = 0; ok && r < reps; r++) {
             if (need_rand)
-                fill_rand_string(randstr_buf, sizeof(randstr_buf));
+                fill_rand_insert(randstr_buf, sizeof(randstr_buf));
             bool rval = q_insert_head(q, inserts);
             if (rval) {
                 qcnt++;
@@ -221,7 +389,9 @@ static bool do_insert_head(int argc, char *argv[])
                            "list element");
                     ok = false;
                     break;
-                } else if (r == 1 && lasts == q->head->value) {
+                } else if (r == 1 && lasts == q->head->value &&
+                           q->store != Q_STORE_INTERN) {
+                    /* Interned queues share equal strings on purpose */
                     report(1,
                            "ERROR: Need to allocate separate string for each "
                            "list element");
@@ -290,10 +460,13 @@ static bool do_insert_tail(int argc, char *argv[])
         report(3, "Warning: Calling insert tail on null queue");
     error_check();
 
+    if (bulk_insert && reps > big_queue_size)
+        return insert_bulk(false, inserts, need_rand, reps);
+
     if (exception_setup(true)) {
         for (int r = 0; ok && r < reps; r++) {
             if (need_rand)
-                fill_rand_string(randstr_buf, sizeof(randstr_buf));
+                fill_rand_insert(randstr_buf, sizeof(randstr_buf));
             bool rval = q_insert_tail(q, inserts);
             if (rval) {
                 qcnt++;
@@ -320,13 +493,112 @@ static bool do_insert_tail(int argc, char *argv[])
     return ok;
 }
 
+/* Most strings removed by each call to q_remove_head_bulk */
+#define REMOVE_BATCH 4096
+/* Size of the buffer the removed strings are drained through */
+#define REMOVE_BUFSIZE (64 * 1024)
+
+/*
+ * Remove reps elements from head of queue, comparing each of them to
+ * expected value checks.  All the strings pass through one buffer, reused
+ * by every call to q_remove_head_bulk.
+ */
+static bool remove_bulk(const char *checks, int reps)
+{
+    char *removes = malloc(REMOVE_BUFSIZE + STRINGPAD);
+    size_t *offsets = malloc(REMOVE_BATCH * sizeof(size_t));
+    if (!removes || !offsets) {
+        report(1,
+               "INTERNAL ERROR.  Could not allocate space for removed strings");
+        free(removes);
+        free(offsets);
+        return false;
+    }
+    memset(removes, 'X', REMOVE_BUFSIZE + STRINGPAD);
+
+    if (!q)
+        report(3, "Warning: Calling remove head on null queue");
+    else if (!q->head)
+        report(3, "Warning: Calling remove head on empty queue");
+    error_check();
+
+    /* Freeing a big queue would be quadratic in cautious mode */
+    if (qcnt > big_queue_size)
+        set_cautious_mode(false);
+
+    /* Each batch is timed on its own, not with the reporting of others */
+    bool ok = true;
+    size_t done = 0;
+    while (ok && done < (size_t) reps) {
+        size_t want = reps - done, got = 0;
+        if (want > REMOVE_BATCH)
+            want = REMOVE_BATCH;
+        if (exception_setup(true))
+            got = q_remove_head_bulk(q, want, removes, REMOVE_BUFSIZE, offsets);
+        exception_cancel();
+        if (!got)
+            break;
+        done += got;
+        qcnt -= got;
+
+        for (size_t i = 0; ok && i < got; i++) {
+            char *s = removes + offsets[i];
+            if (offsets[i] >= REMOVE_BUFSIZE) {
+                report(1, "ERROR: Offset %lu of removed string out of bounds",
+                       (unsigned long) offsets[i]);
+                ok = false;
+            } else if (strncmp(s, checks, string_length)) {
+                report(1, "ERROR: Removed value %s != expected value %s", s,
+                       checks);
+                ok = false;
+            } else {
+                report(2, "Removed %s from queue", s);
+            }
+        }
+
+        /* Padding past the buffer must still hold its initial 'X' */
+        int i = REMOVE_BUFSIZE;
+        while (i < REMOVE_BUFSIZE + STRINGPAD && removes[i] == 'X')
+            i++;
+        if (i != REMOVE_BUFSIZE + STRINGPAD) {
+            report(1,
+                   "ERROR: copying of strings in remove_head_bulk "
+                   "overflowed destination buffer.");
+            ok = false;
+        }
+    }
+    set_cautious_mode(true);
+
+    if (ok && done < (size_t) reps) {
+        fail_count++;
+        report(1, "ERROR: Removed %d of %d elements (%d failures total)",
+               (int) done, reps, fail_count);
+        ok = false;
+    }
+
+    show_queue(3);
+
+    free(removes);
+    free(offsets);
+    return ok && !error_check();
+}
+
 static bool do_remove_head(int argc, char *argv[])
 {
-    if (argc != 1 && argc != 2) {
-        report(1, "%s needs 0-1 arguments", argv[0]);
+    if (argc < 1 || argc > 3) {
+        report(1, "%s needs 0-2 arguments", argv[0]);
         return false;
     }
 
+    if (argc == 3) {
+        int reps;
+        if (!get_int(argv[2], &reps) || reps < 1) {
+            report(1, "Invalid number of removals '%s'", argv[2]);
+            return false;
+        }
+        return remove_bulk(argv[1], reps);
+    }
+
     char *removes = malloc(string_length + STRINGPAD + 1);
     if (!removes) {
         report(1,
@@ -411,13 +683,62 @@ static bool do_remove_head(int argc, char *argv[])
     return ok && !error_check();
 }
 
+/*
+ * Remove reps elements from head of queue at once, without looking at
+ * their strings.
+ */
+static bool remove_bulk_quiet(int reps)
+{
+    if (!q)
+        report(3, "Warning: Calling remove head on null queue");
+    else if (!q->head)
+        report(3, "Warning: Calling remove head on empty queue");
+    error_check();
+
+    if (qcnt > big_queue_size)
+        set_cautious_mode(false);
+
+    size_t done = 0;
+    if (exception_setup(true))
+        done = q_remove_head_bulk(q, reps, NULL, 0, NULL);
+    exception_cancel();
+    set_cautious_mode(true);
+
+    bool ok = true;
+    qcnt -= done;
+    if (done < (size_t) reps) {
+        fail_count++;
+        if (fail_count < fail_limit) {
+            report(2, "Removed %d of %d elements", (int) done, reps);
+        } else {
+            report(1, "ERROR: Removed %d of %d elements (%d failures total)",
+                   (int) done, reps, fail_count);
+            ok = false;
+        }
+    } else {
+        report(2, "Removed %d elements from queue", reps);
+    }
+
+    show_queue(3);
+    return ok && !error_check();
+}
+
 static bool do_remove_head_quiet(int argc, char *argv[])
 {
-    if (argc != 1) {
-        report(1, "%s takes no arguments", argv[0]);
+    if (argc != 1 && argc != 2) {
+        report(1, "%s needs 0-1 arguments", argv[0]);
         return false;
     }
 
+    if (argc == 2) {
+        int reps;
+        if (!get_int(argv[1], &reps) || reps < 1) {
+            report(1, "Invalid number of removals '%s'", argv[1]);
+            return false;
+        }
+        return remove_bulk_quiet(reps);
+    }
+
     bool ok = true;
     if (!q)
         report(3, "Warning: Calling remove head on null queue");
@@ -447,6 +768,106 @@ static bool do_remove_head_quiet(int argc, char *argv[])
     return ok && !error_check();
 }
 
+static bool do_pop_head(int argc, char *argv[])
+{
+    if (argc != 1 && argc != 2) {
+        report(1, "%s needs 0-1 arguments", argv[0]);
+        return false;
+    }
+
+    bool check = argc > 1;
+    bool ok = true;
+    if (!q)
+        report(3, "Warning: Calling pop head on null queue");
+    else if (!q->head)
+        report(3, "Warning: Calling pop head on empty queue");
+    error_check();
+
+    /* Strings with a block of their own must be handed over, not copied */
+    char *held = NULL;
+    if (q && q->head && q->store == Q_STORE_HEAP)
+        held = q->head->value;
+    char *pops = NULL;
+    if (exception_setup(true))
+        pops = q_pop_head(q);
+    exception_cancel();
+
+    if (pops) {
+        qcnt--;
+        if (held && pops != held) {
+            report(1, "ERROR: Popped string was copied");
+            ok = false;
+        } else if (check && strcmp(pops, argv[1])) {
+            report(1, "ERROR: Popped value %s != expected value %s", pops,
+                   argv[1]);
+            ok = false;
+        } else {
+            report(2, "Popped %s from queue", pops);
+        }
+        /* The string now belongs to us, so the harness sees it freed */
+        test_free(pops);
+    } else {
+        fail_count++;
+        if (!check && fail_count < fail_limit) {
+            report(2, "Pop from queue failed");
+        } else {
+            report(1, "ERROR: Pop from queue failed (%d failures total)",
+                   fail_count);
+            ok = false;
+        }
+    }
+
+    show_queue(3);
+    return ok && !error_check();
+}
+
+static bool do_peek_head(int argc, char *argv[])
+{
+    if (argc != 1 && argc != 2) {
+        report(1, "%s needs 0-1 arguments", argv[0]);
+        return false;
+    }
+
+    bool check = argc > 1;
+    bool ok = true;
+    if (!q)
+        report(3, "Warning: Calling peek head on null queue");
+    else if (!q->head)
+        report(3, "Warning: Calling peek head on empty queue");
+    error_check();
+
+    const char *peeks = NULL;
+    if (exception_setup(true))
+        peeks = q_peek_head(q);
+    exception_cancel();
+
+    if (!q || !q->head) {
+        if (peeks) {
+            report(1, "ERROR: Peek at empty queue returned %s", peeks);
+            ok = false;
+        } else if (check) {
+            report(1, "ERROR: Peek found no value, expected %s", argv[1]);
+            ok = false;
+        }
+    } else if (peeks != q->head->value) {
+        report(1, "ERROR: Peek did not return string at head of queue");
+        ok = false;
+    } else if (q_size(q) != qcnt) {
+        report(1, "ERROR: Peek changed queue size to %d, expected %d",
+               q_size(q), (int) qcnt);
+        ok = false;
+    } else if (check && strcmp(peeks, argv[1])) {
+        report(1, "ERROR: Peeked value %s != expected value %s", peeks,
+               argv[1]);
+        ok = false;
+    } else {
+        report(2, "Head of queue is %s", peeks);
+    }
+
+    show_queue(3);
+    return ok && !error_check();
+}
+
 static bool do_reverse(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -531,13 +952,147 @@ static bool do_size(int argc, char *argv[])
     return ok && !error_check();
 }
 
-bool do_sort(int argc, char *argv[])
+/*
+ * Walk the queue, reading the first character of every string as show
+ * does, and return the time taken in seconds
+ */
+static double time_traversal()
+{
+    double t;
+    volatile char sink = 0;
+    int cnt = 0;
+
+    init_time(&t);
+    for (list_ele_t *e = q ? q->head : NULL; e && cnt < qcnt; e = e->next) {
+        sink ^= e->value[0];
+        cnt++;
+    }
+    (void) sink;
+    return delta_time(&t);
+}
+
+/* Compact the queue and report how long a traversal takes before and after */
+static bool compact_queue(int vlevel)
+{
+    bool ok = true;
+    double before = time_traversal();
+    error_check();
+
+    /* Compaction frees old slabs, which cautious mode would make costly */
+    if (qcnt > big_queue_size)
+        set_cautious_mode(false);
+    bool rval = false;
+    if (exception_setup(true))
+        rval = q_compact(q);
+    exception_cancel();
+    set_cautious_mode(true);
+
+    if (rval) {
+        double after = time_traversal();
+        report(vlevel, "Traversal time %.6f -> %.6f seconds (%.2fx speedup)",
+               before, after, after > 0 ? before / after : 1.0);
+    } else {
+        fail_count++;
+        if (fail_count < fail_limit)
+            report(2, "Compaction failed");
+        else {
+            report(1, "ERROR: Compaction failed (%d failures total)",
+                   fail_count);
+            ok = false;
+        }
+    }
+
+    return ok && !error_check();
+}
+
+static bool do_compact(int argc, char *argv[])
 {
     if (argc != 1) {
         report(1, "%s takes no arguments", argv[0]);
         return false;
     }
 
+    if (!q)
+        report(3, "Warning: Calling compact on null queue");
+    error_check();
+
+    bool ok = compact_queue(2);
+    show_queue(3);
+    return ok;
+}
+
+/* Names of sort orders, indexed by q_order_t */
+static const char *order_names[] = {"ascend", "descend", "nocase", "natural",
+                                    "length"};
+
+/*
+ * Compare strings a and b like strcmp, except that runs of digits compare
+ * by value, ignoring leading zeros.  Written apart from the comparison in
+ * queue.c, so that sorts are checked against an independent reference.
+ */
+static int natural_strcmp(const char *a, const char *b)
+{
+    for (;;) {
+        if (isdigit((unsigned char) *a) && isdigit((unsigned char) *b)) {
+            a += strspn(a, "0");
+            b += strspn(b, "0");
+            size_t na = strspn(a, "0123456789");
+            size_t nb = strspn(b, "0123456789");
+            if (na != nb)
+                return na < nb ? -1 : 1;
+            int cmp = strncmp(a, b, na);
+            if (cmp)
+                return cmp;
+            a += na;
+            b += nb;
+        } else if (*a != *b || !*a) {
+            return (unsigned char) *a - (unsigned char) *b;
+        } else {
+            a++;
+            b++;
+        }
+    }
+}
+
+/* Compare strings a and b in the given order, like strcmp */
+static int order_strcmp(q_order_t order, const char *a, const char *b)
+{
+    switch (order) {
+    case Q_ORDER_DESCENDING:
+        return strcmp(b, a);
+    case Q_ORDER_NOCASE:
+        return strcasecmp(a, b);
+    case Q_ORDER_NATURAL:
+        return natural_strcmp(a, b);
+    case Q_ORDER_LENGTH: {
+        size_t la = strlen(a), lb = strlen(b);
+        if (la != lb)
+            return la < lb ? -1 : 1;
+        return strcmp(a, b);
+    }
+    default:
+        return strcmp(a, b);
+    }
+}
+
+bool do_sort(int argc, char *argv[])
+{
+    if (argc != 1 && argc != 2) {
+        report(1, "%s takes 0-1 arguments", argv[0]);
+        return false;
+    }
+
+    q_order_t order = Q_ORDER_ASCENDING;
+    if (argc == 2) {
+        size_t n = sizeof(order_names) / sizeof(order_names[0]);
+        while (order < n && strcmp(argv[1], order_names[order]))
+            order++;
+        if (order == n) {
+            report(1, "Unknown sort order '%s'", argv[1]);
+            return false;
+        }
+    }
+
     if (!q)
         report(3, "Warning: Calling sort on null queue");
     error_check();
@@ -549,23 +1104,632 @@ bool do_sort(int argc, char *argv[])
 
     set_noallocate_mode(true);
     if (exception_setup(true))
-        q_sort(q);
+        q_sort_by(q, order);
     exception_cancel();
     set_noallocate_mode(false);
 
+    if (q && q_sort_compares > 0)
+        report(2, "%lu comparisons, %lu (%.1f%%) decided by comparing strings",
+               (unsigned long) q_sort_compares,
+               (unsigned long) q_sort_fallbacks,
+               100.0 * q_sort_fallbacks / q_sort_compares);
+
     bool ok = true;
     if (q) {
         for (list_ele_t *e = q->head; e && --cnt; e = e->next) {
-            /* Ensure each element in ascending order */
-            /* FIXME: add an option to specify sorting order */
-            if (strcasecmp(e->value, e->next->value) > 0) {
-                report(1, "ERROR: Not sorted in ascending order");
+            /* Ensure each element in the requested order */
+            if (order_strcmp(order, e->value, e->next->value) > 0) {
+                report(1, "ERROR: Not sorted in %s order", order_names[order]);
                 ok = false;
                 break;
             }
         }
     }
 
+    /* Sorting scatters the elements of large queues, so lay them out anew */
+    if (ok && q && autocompact > 0 && qcnt >= autocompact)
+        ok = compact_queue(3);
+
+    show_queue(3);
+    return ok && !error_check();
+}
+
+bool do_sort_k(int argc, char *argv[])
+{
+    if (argc != 2) {
+        report(1, "%s needs 1 argument", argv[0]);
+        return false;
+    }
+
+    int k;
+    if (!get_int(argv[1], &k) || k < 0) {
+        report(1, "Invalid number of elements '%s'", argv[1]);
+        return false;
+    }
+
+    if (!q)
+        report(3, "Warning: Calling sortk on null queue");
+    error_check();
+
+    int cnt = q_size(q);
+    set_noallocate_mode(true);
+    if (exception_setup(true))
+        q_sort_k(q, k);
+    exception_cancel();
+    set_noallocate_mode(false);
+
+    if (q && q_sort_compares > 0)
+        report(2, "%lu comparisons, %lu (%.1f%%) decided by comparing strings",
+               (unsigned long) q_sort_compares,
+               (unsigned long) q_sort_fallbacks,
+               100.0 * q_sort_fallbacks / q_sort_compares);
+
+    bool ok = true;
+    if (q) {
+        /*
+         * The first k elements ascend, and none after them is smaller.
+         * With k == 0 there is nothing to check.
+         */
+        list_ele_t *kth = NULL;
+        int i = 0;
+        for (list_ele_t *e = q->head; e && i < cnt; e = e->next, i++) {
+            if (i < k) {
+                if (kth && strcmp(kth->value, e->value) > 0) {
+                    report(1, "ERROR: First %d elements not in ascending order",
+                           k);
+                    ok = false;
+                    break;
+                }
+                kth = e;
+            } else if (kth && strcmp(kth->value, e->value) > 0) {
+                report(1, "ERROR: Element '%s' belongs among the first %d",
+                       e->value, k);
+                ok = false;
+                break;
+            }
+        }
+    }
+
+    show_queue(3);
+    return ok && !error_check();
+}
+
+/* Most queues merge can deal out to */
+#define MAXMERGE 1024
+
+bool do_merge(int argc, char *argv[])
+{
+    if (argc != 2) {
+        report(1, "%s needs 1 argument", argv[0]);
+        return false;
+    }
+
+    int k;
+    if (!get_int(argv[1], &k) || k < 1 || k > MAXMERGE) {
+        report(1, "Invalid number of queues '%s'", argv[1]);
+        return false;
+    }
+
+    if (!q) {
+        report(3, "Warning: Calling merge on null queue");
+        error_check();
+        bool rval = true;
+        if (exception_setup(true))
+            rval = q_merge(&q, 1);
+        exception_cancel();
+        if (rval) {
+            report(1, "ERROR: Merge into null queue succeeded");
+            return false;
+        }
+        return !error_check();
+    }
+
+    /* The queues to merge store strings the same way as q */
+    int store_mode = q_store_mode, key_mode = q_key_mode;
+    q_store_mode = q->store;
+    q_key_mode = q->keys;
+    queue_t *qs[MAXMERGE];
+    qs[0] = q;
+    bool setup = true;
+    int made = 1;
+    for (; setup && made < k; made++) {
+        qs[made] = q_new();
+        setup = qs[made] != NULL;
+    }
+    q_store_mode = store_mode;
+    q_key_mode = key_mode;
+    if (!setup)
+        made--;
+
+    /* Deal the elements out round robin, and sort every queue */
+    bool ok = true;
+    size_t cnt = qcnt;
+    if (qcnt > big_queue_size)
+        set_cautious_mode(false);
+    for (size_t i = 0; setup && ok && i < cnt; i++) {
+        if (!q->head) {
+            report(1, "ERROR: Queue ran out after %d elements", (int) i);
+            ok = false;
+        } else if (!q_insert_tail(qs[i % k], q->head->value)) {
+            setup = false;
+        } else if (!q_remove_head(q, NULL, 0)) {
+            report(1, "ERROR: Removal from queue failed");
+            qcnt++;
+            ok = false;
+        }
+    }
+    set_cautious_mode(true);
+
+    /* Failing to set up the merge counts like any failed insertion */
+    if (!setup) {
+        fail_count++;
+        if (fail_count < fail_limit) {
+            report(2, "Setting up %d queues to merge failed", k);
+        } else {
+            report(1,
+                   "ERROR: Setting up %d queues to merge failed (%d failures "
+                   "total)",
+                   k, fail_count);
+            ok = false;
+        }
+    }
+
+    for (int i = 0; setup && ok && i < k; i++)
+        q_sort(qs[i]);
+
+    bool merged = false;
+    if (setup && ok) {
+        set_noallocate_mode(true);
+        if (exception_setup(true))
+            merged = q_merge(qs, k);
+        exception_cancel();
+        set_noallocate_mode(false);
+        if (!merged) {
+            report(1, "ERROR: Could not merge queues");
+            ok = false;
+        }
+    }
+
+    if (merged) {
+        if (q_size(q) != qcnt) {
+            report(1, "ERROR: Merged queue holds %d elements, expected %d",
+                   q_size(q), (int) qcnt);
+            ok = false;
+        }
+        for (int i = 1; ok && i < k; i++) {
+            if (qs[i]->head || q_size(qs[i])) {
+                report(1, "ERROR: Queue %d not empty after merge", i);
+                ok = false;
+            }
+        }
+        list_ele_t *e = q->head;
+        for (size_t i = 1; ok && e && i < qcnt; i++, e = e->next) {
+            if (strcmp(e->value, e->next->value) > 0) {
+                report(1, "ERROR: Not sorted in ascending order");
+                ok = false;
+            }
+        }
+        if (ok && qcnt && q->tail != e) {
+            report(1, "ERROR: Tail not updated by merge");
+            ok = false;
+        }
+        if (ok)
+            report(2, "Merged %d queues", k);
+    } else {
+        /*
+         * Hand the elements dealt out back to q.  Merging relinks them
+         * without allocating, so none can be lost on the way.
+         */
+        bool back = true;
+        if (exception_setup(true))
+            back = q_merge(qs, made);
+        exception_cancel();
+        if (!back) {
+            report(1, "ERROR: Could not move elements back to queue");
+            ok = false;
+        }
+    }
+
+    for (int i = 1; i < made; i++)
+        q_free(qs[i]);
+
+    show_queue(3);
+    return ok && !error_check();
+}
+
+/* Longest string in a searched input */
+#define SEARCH_STRLEN 31
+
+/* Most steps in a searched input */
+#define MAXSEARCH 100000
+
+/* Timed runs of each input, of which the fastest counts */
+#define SEARCH_REPEATS 3
+
+/* Operations search can look for slow inputs to */
+typedef enum { SEARCH_SORT, SEARCH_REVERSE, SEARCH_OPS } search_op_t;
+
+static const char *search_names[] = {"sort", "reverse", "ops"};
+
+/* One step of a searched input: insert at head or tail, or remove head */
+typedef struct {
+    char op; /* 'h', 't' or 'r' */
+    char str[SEARCH_STRLEN + 1];
+} search_step_t;
+
+/*
+ * Measure the cost of an input of n steps to operation op: comparisons
+ * made by sort, or the fewest cycles taken by reverse or by running the
+ * steps themselves.  Return -1 if a queue operation failed.
+ */
+static int64_t search_cost(search_op_t op, search_step_t *steps, int n)
+{
+    int64_t best = -1;
+
+    for (int r = 0; r < SEARCH_REPEATS; r++) {
+        queue_t *sq = q_new();
+        if (!sq)
+            return -1;
+
+        bool ok = true;
+        int64_t start = cpucycles();
+        for (int i = 0; ok && i < n; i++) {
+            if (op == SEARCH_OPS && i == 0)
+                start = cpucycles();
+            if (steps[i].op == 'h')
+                ok = q_insert_head(sq, steps[i].str);
+            else if (steps[i].op == 't')
+                ok = q_insert_tail(sq, steps[i].str);
+            else if (sq->head)
+                ok = q_remove_head(sq, NULL, 0);
+        }
+        if (op != SEARCH_OPS)
+            start = cpucycles();
+        if (op == SEARCH_SORT)
+            q_sort(sq);
+        else if (op == SEARCH_REVERSE)
+            q_reverse(sq);
+        int64_t cycles = cpucycles() - start;
+        q_free(sq);
+
+        if (!ok)
+            return -1;
+        /* Comparison counts do not vary between runs */
+        if (op == SEARCH_SORT)
+            return q_sort_compares;
+        if (best < 0 || cycles < best)
+            best = cycles;
+    }
+    return best;
+}
+
+/* Apply one random mutation to an input of n steps */
+static void search_mutate(search_op_t op, search_step_t *steps, int n)
+{
+    int i = rand() % n, j = rand() % n;
+    if (i > j) {
+        int t = i;
+        i = j;
+        j = t;
+    }
+
+    switch (rand() % 7) {
+    case 0: {
+        /* Swap two steps */
+        search_step_t t = steps[i];
+        steps[i] = steps[j];
+        steps[j] = t;
+        break;
+    }
+    case 1:
+        /* Reverse a stretch of steps */
+        for (; i < j; i++, j--) {
+            search_step_t t = steps[i];
+            steps[i] = steps[j];
+            steps[j] = t;
+        }
+        break;
+    case 2:
+        /* Sort a stretch of steps by string, making a run */
+        for (int a = i + 1; a <= j; a++) {
+            search_step_t t = steps[a];
+            int b = a;
+            for (; b > i && strcmp(steps[b - 1].str, t.str) > 0; b--)
+                steps[b] = steps[b - 1];
+            steps[b] = t;
+        }
+        break;
+    case 3:
+        fill_rand_string(steps[i].str, SEARCH_STRLEN + 1);
+        break;
+    case 4:
+        /* Duplicate a string */
+        strcpy(steps[i].str, steps[j].str);
+        break;
+    case 5: {
+        /* Give two strings a common prefix */
+        size_t len = strlen(steps[j].str);
+        size_t k = rand() % (SEARCH_STRLEN + 1);
+        if (k > len)
+            k = len;
+        size_t rest = strlen(steps[i].str);
+        if (k + rest > SEARCH_STRLEN)
+            rest = SEARCH_STRLEN - k;
+        memmove(steps[i].str + k, steps[i].str, rest);
+        memcpy(steps[i].str, steps[j].str, k);
+        steps[i].str[k + rest] = '\0';
+        break;
+    }
+    default:
+        if (op == SEARCH_OPS)
+            steps[i].op = "htr"[rand() % 3];
+        break;
+    }
+}
+
+/* Write an input of n steps to op as a trace file */
+static bool search_save(const char *name,
+                        search_op_t op,
+                        search_step_t *steps,
+                        int n,
+                        int64_t cost)
+{
+    FILE *f = fopen(name, "w");
+    if (!f)
+        return false;
+
+    fprintf(f, "# Slowest input to %s found by search (cost %lld %s)\n",
+            search_names[op], (long long) cost,
+            op == SEARCH_SORT ? "comparisons" : "cycles");
+    /* Replays must build and sort the queue the way the search did */
+    fprintf(f, "option fail 0\noption malloc 0\n");
+    fprintf(f, "option storage %d\noption keys %d\n", q_store_mode,
+            q_key_mode);
+    fprintf(f, "option algo %d\noption threads %d\n", q_sort_algo,
+            q_sort_threads);
+    fprintf(f, "new\n");
+    int size = 0;
+    for (int i = 0; i < n; i++) {
+        if (steps[i].op == 'r') {
+            /* Removals from an empty queue were skipped */
+            if (size) {
+                fprintf(f, "rhq\n");
+                size--;
+            }
+        } else {
+            fprintf(f, "%s %s\n", steps[i].op == 'h' ? "ih" : "it",
+                    steps[i].str);
+            size++;
+        }
+    }
+    if (op != SEARCH_OPS)
+        fprintf(f, "%s\n", search_names[op]);
+    fprintf(f, "free\n");
+    return fclose(f) == 0;
+}
+
+/*
+ * Search for slow inputs by hill climbing: mutate the slowest input found
+ * so far, and keep the mutant whenever it costs more.
+ */
+bool do_search(int argc, char *argv[])
+{
+    if (argc != 4 && argc != 5) {
+        report(1, "%s needs 3-4 arguments", argv[0]);
+        return false;
+    }
+
+    search_op_t op = SEARCH_SORT;
+    while (op <= SEARCH_OPS && strcmp(argv[1], search_names[op]))
+        op++;
+    if (op > SEARCH_OPS) {
+        report(1, "Unknown operation '%s'", argv[1]);
+        return false;
+    }
+
+    int n, tries;
+    if (!get_int(argv[2], &n) || n < 1 || n > MAXSEARCH) {
+        report(1, "Invalid number of steps '%s'", argv[2]);
+        return false;
+    }
+    if (!get_int(argv[3], &tries) || tries < 0) {
+        report(1, "Invalid number of tries '%s'", argv[3]);
+        return false;
+    }
+
+    search_step_t *best = malloc(n * sizeof(search_step_t));
+    search_step_t *child = malloc(n * sizeof(search_step_t));
+    if (!best || !child) {
+        free(best);
+        free(child);
+        report(1, "ERROR: Could not allocate search inputs");
+        return false;
+    }
+
+    for (int i = 0; i < n; i++) {
+        best[i].op = 't';
+        if (op == SEARCH_OPS && rand() % 3 == 0)
+            best[i].op = rand() % 2 ? 'h' : 'r';
+        fill_rand_string(best[i].str, SEARCH_STRLEN + 1);
+    }
+
+    /* Failing allocations and cautious frees would drown the costs */
+    int saved_probability = fail_probability;
+    fail_probability = 0;
+    set_cautious_mode(false);
+
+    bool ok = true;
+    int64_t best_cost = -1;
+    if (exception_setup(true))
+        best_cost = search_cost(op, best, n);
+    exception_cancel();
+    for (int i = 0; best_cost >= 0 && i < tries; i++) {
+        memcpy(child, best, n * sizeof(search_step_t));
+        for (int m = 1 + rand() % 4; m > 0; m--)
+            search_mutate(op, child, n);
+
+        int64_t cost = -1;
+        if (exception_setup(true))
+            cost = search_cost(op, child, n);
+        exception_cancel();
+        if (cost > best_cost) {
+            search_step_t *t = best;
+            best = child;
+            child = t;
+            best_cost = cost;
+            report(2, "Try %d: cost %lld", i + 1, (long long) best_cost);
+        }
+    }
+
+    set_cautious_mode(true);
+    fail_probability = saved_probability;
+
+    if (best_cost < 0) {
+        report(1, "ERROR: Could not run %s on searched input", argv[1]);
+        ok = false;
+    } else {
+        report(1, "Slowest input to %s costs %lld %s", argv[1],
+               (long long) best_cost,
+               op == SEARCH_SORT ? "comparisons" : "cycles");
+        if (argc == 5 && !search_save(argv[4], op, best, n, best_cost)) {
+            report(1, "ERROR: Could not write trace file '%s'", argv[4]);
+            ok = false;
+        }
+    }
+
+    free(best);
+    free(child);
+    return ok && !error_check();
+}
+
+/* String of a queue element and its position, for the dedup reference */
+typedef struct {
+    char *s;
+    size_t i;
+} dedup_ref_t;
+
+static int dedup_ref_cmp(const void *a, const void *b)
+{
+    const dedup_ref_t *ra = a, *rb = b;
+    int cmp = strcmp(ra->s, rb->s);
+    if (cmp)
+        return cmp;
+    return (ra->i > rb->i) - (ra->i < rb->i);
+}
+
+bool do_dedup(int argc, char *argv[])
+{
+    if (argc != 1 && (argc != 2 || strcmp(argv[1], "sorted"))) {
+        report(1, "%s takes no argument other than 'sorted'", argv[0]);
+        return false;
+    }
+    bool sorted = argc == 2;
+
+    if (!q)
+        report(3, "Warning: Calling dedup on null queue");
+    error_check();
+
+    /* Work out which strings should survive, by sorting copies of them */
+    size_t cnt = qcnt;
+    dedup_ref_t *refs = malloc((cnt ? cnt : 1) * sizeof(dedup_ref_t));
+    bool *keep = malloc((cnt ? cnt : 1) * sizeof(bool));
+    bool ok = refs && keep;
+    size_t made = 0;
+    list_ele_t *e = q ? q->head : NULL;
+    for (; ok && e && made < cnt; e = e->next, made++) {
+        refs[made].s = strdup(e->value);
+        refs[made].i = made;
+        ok = refs[made].s != NULL;
+    }
+    if (!ok) {
+        report(1, "ERROR: Could not copy queue for reference");
+    } else if (sorted) {
+        /* Only neighbours are compared */
+        size_t last = 0;
+        for (size_t i = 0; i < made; i++) {
+            keep[i] = !i || strcmp(refs[last].s, refs[i].s);
+            if (keep[i])
+                last = i;
+        }
+    } else {
+        qsort(refs, made, sizeof(dedup_ref_t), dedup_ref_cmp);
+        for (size_t i = 0; i < made; i++)
+            keep[refs[i].i] = !i || strcmp(refs[i - 1].s, refs[i].s);
+        /* Back to queue order */
+        for (size_t i = 0; i < made;) {
+            if (refs[i].i == i) {
+                i++;
+            } else {
+                dedup_ref_t t = refs[refs[i].i];
+                refs[refs[i].i] = refs[i];
+                refs[i] = t;
+            }
+        }
+    }
+
+    /*
+     * Building the reference costs more than deleting the duplicates, so
+     * the time of q_delete_dup is reported on its own as well.
+     */
+    bool rval = false;
+    if (ok) {
+        double t;
+        if (qcnt > big_queue_size)
+            set_cautious_mode(false);
+        init_time(&t);
+        if (exception_setup(true))
+            rval = q_delete_dup(q, sorted);
+        exception_cancel();
+        t = delta_time(&t);
+        set_cautious_mode(true);
+        report(2, "Time to delete duplicates = %.3f", t);
+    }
+
+    if (ok && rval) {
+        size_t i = 0;
+        list_ele_t *last = NULL;
+        e = q->head;
+        for (size_t r = 0; ok && r < made; r++) {
+            if (!keep[r])
+                continue;
+            if (!e || strcmp(e->value, refs[r].s)) {
+                report(1, "ERROR: Expected %s after %lu kept elements",
+                       refs[r].s, (unsigned long) i);
+                ok = false;
+            } else {
+                last = e;
+                e = e->next;
+                i++;
+            }
+        }
+        if (ok && q->tail != last) {
+            report(1, "ERROR: Tail not updated by dedup");
+            ok = false;
+        }
+        if (ok && (e || q_size(q) != i)) {
+            report(1, "ERROR: Queue holds %d elements, expected %lu",
+                   q_size(q), (unsigned long) i);
+            ok = false;
+        }
+        if (ok)
+            report(2, "Deleted %lu duplicates", (unsigned long) (qcnt - i));
+        qcnt = i;
+    } else if (ok && q) {
+        fail_count++;
+        if (fail_count < fail_limit) {
+            report(2, "Deleting duplicates failed");
+        } else {
+            report(1, "ERROR: Deleting duplicates failed (%d failures total)",
+                   fail_count);
+            ok = false;
+        }
+    }
+
+    for (size_t i = 0; i < made; i++)
+        free(refs[i].s);
+    free(refs);
+    free(keep);
+
     show_queue(3);
     return ok && !error_check();
 }
@@ -626,6 +1790,26 @@ static bool do_show(int argc, char *argv[])
     return show_queue(0);
 }
 
+static bool do_mem(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+
+    if (!q)
+        report(3, "Warning: Calling mem on null queue");
+    error_check();
+
+    size_t bytes = q_footprint(q);
+    if (qcnt)
+        report(2, "Queue holds %lu bytes, %.1f bytes per element", bytes,
+               (double) bytes / qcnt);
+    else
+        report(2, "Queue holds %lu bytes", bytes);
+    return !error_check();
+}
+
 /* Signal handlers */
 static void sigsegvhandler(int sig)
 {
@@ -1,3 +1,8 @@
+#include <ctype.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,6 +10,548 @@
 #include "harness.h"
 #include "queue.h"
 
+/*
+ * Bytes a typical malloc sets aside for a block with the given payload:
+ * a size_t header, rounded up to a multiple of two size_t, and no less
+ * than four size_t.
+ */
+static inline size_t block_bytes(size_t payload)
+{
+    size_t align = 2 * sizeof(size_t);
+    size_t n = (payload + sizeof(size_t) + align - 1) & ~(align - 1);
+    return n < 2 * align ? 2 * align : n;
+}
+
+/*
+ * List element of a queue with sort keys.  The key follows the fields
+ * every element has, so that queues without keys keep their elements
+ * smaller.
+ */
+typedef struct {
+    list_ele_t ele;
+    uint64_t key; /* Sort key derived from value, see q_key_t */
+} keyed_ele_t;
+
+/* Sort key of element e, which must belong to a queue with keys */
+static inline uint64_t ele_key(const list_ele_t *e)
+{
+    return ((const keyed_ele_t *) e)->key;
+}
+
+/* Bytes taken by each list element of queue q */
+static inline size_t ele_size(const queue_t *q)
+{
+    return q->keys == Q_KEY_NONE ? sizeof(list_ele_t) : sizeof(keyed_ele_t);
+}
+
+/*
+ * Bounds on the number of list elements carved out of each slab.
+ * Every new slab doubles the previous one up to SLAB_MAX_NODES, so a
+ * queue of n elements needs O(log n) slab allocations.
+ */
+#define SLAB_MIN_NODES 64
+#define SLAB_MAX_NODES 65536
+
+/*
+ * Slab of list elements.
+ * Elements are handed out in address order until the slab is used up,
+ * so a run of insertions ends up in contiguous memory.
+ */
+struct SLAB {
+    struct SLAB *next;
+    size_t used; /* Number of elements handed out so far */
+    size_t cap;  /* Number of elements the slab holds */
+    list_ele_t nodes[]; /* Elements, each taking ele_size bytes */
+};
+
+/* Element i of slab, whose elements take size bytes each */
+static inline list_ele_t *slab_node(struct SLAB *slab, size_t i, size_t size)
+{
+    return (list_ele_t *) ((char *) slab->nodes + i * size);
+}
+
+/*
+ * Allocate an empty slab holding cap elements, charged to queue q.
+ * Return NULL if could not allocate space.
+ */
+static struct SLAB *slab_new(queue_t *q, size_t cap)
+{
+    size_t payload = sizeof(struct SLAB) + cap * ele_size(q);
+    struct SLAB *slab = malloc(payload);
+    if (!slab)
+        return NULL;
+
+    q->bytes += block_bytes(payload);
+    slab->used = 0;
+    slab->cap = cap;
+    slab->next = NULL;
+    return slab;
+}
+
+/*
+ * Free every slab in list slabs, along with the strings of their elements
+ * if free_strings is set.
+ * The strings are found by scanning each slab in address order rather
+ * than chasing next pointers, so the walk stays sequential no matter how
+ * the list has been reordered.  Recycled elements have a NULL value.
+ * Cells are visited from the end of the slab, releasing strings in
+ * roughly the reverse order of their allocation.
+ */
+static void slabs_destroy(queue_t *q, struct SLAB *slabs, bool free_strings)
+{
+    size_t size = ele_size(q);
+
+    while (slabs) {
+        struct SLAB *next = slabs->next;
+        for (size_t i = slabs->used; free_strings && i > 0; i--)
+            free(slab_node(slabs, i - 1, size)->value);
+        q->bytes -= block_bytes(sizeof(struct SLAB) + slabs->cap * size);
+        free(slabs);
+        slabs = next;
+    }
+}
+
+/*
+ * Add a new slab to the node pool, holding at least want elements.
+ * Return false if could not allocate space.
+ */
+static bool pool_grow(queue_t *q, size_t want)
+{
+    size_t cap = q->slabs ? q->slabs->cap << 1 : SLAB_MIN_NODES;
+    if (cap > SLAB_MAX_NODES)
+        cap = SLAB_MAX_NODES;
+    if (cap < want)
+        cap = want;
+
+    struct SLAB *slab = slab_new(q, cap);
+    if (!slab)
+        return false;
+
+    slab->next = q->slabs;
+    q->slabs = slab;
+    return true;
+}
+
+/*
+ * Take a list element from the node pool.
+ * Recycled elements are preferred over fresh ones.
+ * Return NULL if could not allocate space.
+ */
+static list_ele_t *ele_alloc(queue_t *q)
+{
+    list_ele_t *e = q->free_nodes;
+    if (e) {
+        q->free_nodes = e->next;
+        return e;
+    }
+
+    if ((!q->slabs || q->slabs->used == q->slabs->cap) && !pool_grow(q, 0))
+        return NULL;
+    return slab_node(q->slabs, q->slabs->used++, ele_size(q));
+}
+
+/* Give a list element back to the node pool */
+static void ele_release(queue_t *q, list_ele_t *e)
+{
+    e->value = NULL;
+    e->next = q->free_nodes;
+    q->free_nodes = e;
+}
+
+/* Storage strategy picked up by q_new */
+int q_store_mode = Q_STORE_HEAP;
+
+/* Default capacity of an arena chunk, in bytes */
+#define ARENA_CHUNK_SIZE 65536
+
+/*
+ * Chunk of the string arena used by Q_STORE_ARENA queues.
+ * Strings are appended back to back and never freed individually.
+ */
+struct CHUNK {
+    struct CHUNK *next;
+    size_t used; /* Number of bytes handed out so far */
+    size_t cap;  /* Number of bytes the chunk holds */
+    char data[];
+};
+
+/*
+ * Add a chunk able to hold at least len bytes to the front of the arena.
+ * Return false if could not allocate space.
+ */
+static bool arena_grow(struct CHUNK **chunks, size_t len, size_t *bytes)
+{
+    size_t cap = len > ARENA_CHUNK_SIZE ? len : ARENA_CHUNK_SIZE;
+    struct CHUNK *c = malloc(sizeof(struct CHUNK) + cap);
+    if (!c)
+        return false;
+
+    *bytes += block_bytes(sizeof(struct CHUNK) + cap);
+    c->used = 0;
+    c->cap = cap;
+    c->next = *chunks;
+    *chunks = c;
+    return true;
+}
+
+/*
+ * Reserve len bytes in the arena.
+ * Return NULL if could not allocate space.
+ */
+static char *arena_alloc(queue_t *q, size_t len)
+{
+    struct CHUNK *c = q->chunks;
+    if ((!c || c->cap - c->used < len) &&
+        !arena_grow(&q->chunks, len, &q->bytes))
+        return NULL;
+
+    c = q->chunks;
+    char *p = c->data + c->used;
+    c->used += len;
+    q->arena_live += len;
+    return p;
+}
+
+/* Free every chunk in list chunks */
+static void arena_destroy(struct CHUNK *chunks, size_t *bytes)
+{
+    while (chunks) {
+        struct CHUNK *next = chunks->next;
+        *bytes -= block_bytes(sizeof(struct CHUNK) + chunks->cap);
+        free(chunks);
+        chunks = next;
+    }
+}
+
+/*
+ * Copy the live strings into fresh chunks, in list order, and drop the
+ * old chunks along with the holes left by removed strings.
+ * The arena is left untouched if the new chunks cannot be allocated.
+ */
+static void arena_compact(queue_t *q)
+{
+    struct CHUNK *fresh = NULL;
+    if (q->arena_live && !arena_grow(&fresh, q->arena_live, &q->bytes))
+        return;
+
+    for (list_ele_t *e = q->head; e; e = e->next) {
+        size_t len = e->len + 1;
+        e->value = memcpy(fresh->data + fresh->used, e->value, len);
+        fresh->used += len;
+    }
+
+    arena_destroy(q->chunks, &q->bytes);
+    q->chunks = fresh;
+    q->arena_dead = 0;
+}
+
+/* Initial number of buckets in the interning table */
+#define ATOM_MIN_BUCKETS 64
+
+/*
+ * Interned string shared by all elements of a Q_STORE_INTERN queue
+ * holding an equal string.  Element values point at str.
+ */
+struct ATOM {
+    struct ATOM *next; /* Next atom in the same bucket */
+    size_t refcnt;     /* Number of elements sharing the string */
+    uint32_t hash;
+    char str[];
+};
+
+/* Find the atom holding string value */
+static inline struct ATOM *atom_of(char *value)
+{
+    return (struct ATOM *) (value - offsetof(struct ATOM, str));
+}
+
+/* FNV-1a hash of the first len bytes of s */
+static uint32_t hash_string(const char *s, size_t len)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char) s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/*
+ * Double the number of buckets of the interning table.
+ * Return false if could not allocate space.
+ */
+static bool atoms_grow(queue_t *q)
+{
+    size_t n = q->atom_buckets ? q->atom_buckets << 1 : ATOM_MIN_BUCKETS;
+    struct ATOM **buckets = malloc(n * sizeof(struct ATOM *));
+    if (!buckets)
+        return false;
+    memset(buckets, 0, n * sizeof(struct ATOM *));
+
+    for (size_t i = 0; i < q->atom_buckets; i++) {
+        struct ATOM *a = q->atoms[i];
+        while (a) {
+            struct ATOM *next = a->next;
+            a->next = buckets[a->hash & (n - 1)];
+            buckets[a->hash & (n - 1)] = a;
+            a = next;
+        }
+    }
+
+    if (q->atoms)
+        q->bytes -= block_bytes(q->atom_buckets * sizeof(struct ATOM *));
+    q->bytes += block_bytes(n * sizeof(struct ATOM *));
+    free(q->atoms);
+    q->atoms = buckets;
+    q->atom_buckets = n;
+    return true;
+}
+
+/*
+ * Take a reference to the interned copy of string s of len bytes,
+ * terminator included, interning it first if needed.
+ * Return NULL if could not allocate space.
+ */
+static char *atom_get(queue_t *q, const char *s, size_t len)
+{
+    uint32_t hash = hash_string(s, len);
+    if (q->atoms) {
+        struct ATOM *a = q->atoms[hash & (q->atom_buckets - 1)];
+        for (; a; a = a->next) {
+            if (a->hash == hash && !strcmp(a->str, s)) {
+                a->refcnt++;
+                return a->str;
+            }
+        }
+    }
+
+    /* Keep the load factor at most one */
+    if (q->atom_count >= q->atom_buckets && !atoms_grow(q))
+        return NULL;
+
+    struct ATOM *a = malloc(sizeof(struct ATOM) + len);
+    if (!a)
+        return NULL;
+    q->bytes += block_bytes(sizeof(struct ATOM) + len);
+    a->refcnt = 1;
+    a->hash = hash;
+    memcpy(a->str, s, len);
+    a->next = q->atoms[hash & (q->atom_buckets - 1)];
+    q->atoms[hash & (q->atom_buckets - 1)] = a;
+    q->atom_count++;
+    return a->str;
+}
+
+/*
+ * Take atom a, holding a string of len bytes, out of the interning table.
+ * The atom itself is left to the caller.
+ */
+static void atom_unlink(queue_t *q, struct ATOM *a, size_t len)
+{
+    struct ATOM **p = &q->atoms[a->hash & (q->atom_buckets - 1)];
+    while (*p != a)
+        p = &(*p)->next;
+    *p = a->next;
+    q->atom_count--;
+    q->bytes -= block_bytes(sizeof(struct ATOM) + len);
+}
+
+/*
+ * Drop a reference to interned string value of len bytes, terminator
+ * included, freeing it with the last one
+ */
+static void atom_put(queue_t *q, char *value, size_t len)
+{
+    struct ATOM *a = atom_of(value);
+    if (--a->refcnt)
+        return;
+
+    atom_unlink(q, a, len);
+    free(a);
+}
+
+/* Free the interning table along with every atom in it */
+static void atoms_destroy(queue_t *q)
+{
+    for (size_t i = 0; i < q->atom_buckets; i++) {
+        struct ATOM *a = q->atoms[i];
+        while (a) {
+            struct ATOM *next = a->next;
+            free(a);
+            a = next;
+        }
+    }
+    free(q->atoms);
+}
+
+/* Sort keys picked up by q_new */
+int q_key_mode = Q_KEY_NONE;
+
+/*
+ * Flag set in the key of an element whose string could not be packed.
+ * Packed keys only use the low 60 bits.
+ */
+#define KEY_UNPACKED (UINT64_C(1) << 63)
+
+/* Longest string that fits a packed key */
+#define KEY_PACKED_CHARS 12
+
+/* Number of leading bytes held by a prefix key */
+#define KEY_PREFIX_CHARS 8
+
+/*
+ * Compute the key of string s of length len for a queue using key mode
+ * keys.  A packed key holds the letters 'a' to 'z' as 1 to 26 in 5-bit
+ * fields, first letter in the most significant field, padded with 0.
+ * Comparing two packed keys as integers thus orders the strings like
+ * strcmp, and equal packed keys mean equal strings.
+ * A prefix key holds the first bytes of any string the same way, one
+ * byte per field, so only strings sharing the whole prefix need to be
+ * compared.  A folded key does the same with the bytes in lower case,
+ * ordering strings like strcasecmp instead.
+ */
+static uint64_t key_of(q_key_t keys, const char *s, size_t len)
+{
+    uint64_t key = 0;
+
+    if (keys == Q_KEY_PREFIX || keys == Q_KEY_FOLDED) {
+        for (size_t i = 0; i < KEY_PREFIX_CHARS; i++) {
+            int c = i < len ? (unsigned char) s[i] : 0;
+            if (keys == Q_KEY_FOLDED)
+                c = tolower(c);
+            key = (key << 8) | c;
+        }
+        return key;
+    }
+
+    if (keys != Q_KEY_PACKED || len > KEY_PACKED_CHARS)
+        return KEY_UNPACKED;
+
+    for (size_t i = 0; i < KEY_PACKED_CHARS; i++) {
+        unsigned int c = 0;
+        if (i < len) {
+            if (s[i] < 'a' || s[i] > 'z')
+                return KEY_UNPACKED;
+            c = s[i] - 'a' + 1;
+        }
+        key = (key << 5) | c;
+    }
+    return key;
+}
+
+/* Set the sort key of element e of queue q, holding string s of length len */
+static inline void ele_set_key(queue_t *q,
+                               list_ele_t *e,
+                               const char *s,
+                               size_t len)
+{
+    if (q->keys != Q_KEY_NONE)
+        ((keyed_ele_t *) e)->key = key_of(q->keys, s, len);
+}
+
+/*
+ * Create a list element holding a copy of string s of length slen.
+ * Return NULL if could not allocate space.
+ */
+static list_ele_t *ele_new(queue_t *q, const char *s, size_t slen)
+{
+    size_t len = slen + 1;
+    list_ele_t *e;
+
+    if (q->store == Q_STORE_INLINE) {
+        /* One block holds both the element and, right after it, its string */
+        e = malloc(ele_size(q) + len);
+        if (!e)
+            return NULL;
+        q->bytes += block_bytes(ele_size(q) + len);
+        e->value = (char *) e + ele_size(q);
+        e->len = len - 1;
+        ele_set_key(q, e, s, len - 1);
+        memcpy(e->value, s, len);
+        e->next = NULL;
+        return e;
+    }
+
+    e = ele_alloc(q);
+    if (!e)
+        return NULL;
+
+    /* What if either call to malloc returns NULL? */
+    switch (q->store) {
+    case Q_STORE_ARENA:
+        e->value = arena_alloc(q, len);
+        break;
+    case Q_STORE_INTERN:
+        /* Equal strings are already in place */
+        e->value = atom_get(q, s, len);
+        break;
+    default:
+        e->value = malloc(len);
+        if (e->value)
+            q->bytes += block_bytes(len);
+    }
+    if (!e->value) {
+        ele_release(q, e);
+        return NULL;
+    }
+
+    /* Copy the string */
+    if (q->store != Q_STORE_INTERN)
+        memcpy(e->value, s, len);
+    e->len = len - 1;
+    ele_set_key(q, e, s, len - 1);
+    e->next = NULL;
+    return e;
+}
+
+/*
+ * Rebuild the arena without its holes once they outweigh the live
+ * strings, keeping the cost of compaction amortized over removals.
+ */
+static void arena_reclaim(queue_t *q)
+{
+    if (q->arena_dead > ARENA_CHUNK_SIZE && q->arena_dead > q->arena_live)
+        arena_compact(q);
+}
+
+/*
+ * Free the string held by list element e and the element itself, leaving
+ * the hole an arena string leaves behind for the caller to reclaim
+ */
+static void ele_discard(queue_t *q, list_ele_t *e)
+{
+    size_t len = e->len + 1;
+
+    switch (q->store) {
+    case Q_STORE_INLINE:
+        q->bytes -= block_bytes(ele_size(q) + len);
+        free(e);
+        return;
+    case Q_STORE_ARENA:
+        /* The string stays in the arena as a hole */
+        ele_release(q, e);
+        q->arena_live -= len;
+        q->arena_dead += len;
+        return;
+    case Q_STORE_INTERN:
+        atom_put(q, e->value, len);
+        ele_release(q, e);
+        return;
+    default:
+        q->bytes -= block_bytes(len);
+        free(e->value);
+        ele_release(q, e);
+    }
+}
+
+/* Free the string held by list element e and the element itself */
+static void ele_delete(queue_t *q, list_ele_t *e)
+{
+    ele_discard(q, e);
+    if (q->store == Q_STORE_ARENA)
+        arena_reclaim(q);
+}
+
 /*
  * Create empty queue.
  * Return NULL if could not allocate space.
@@ -18,6 +565,42 @@ queue_t *q_new()
     q->head = NULL;
     q->tail = NULL;
     q->size = 0;
+    q->bytes = block_bytes(sizeof(queue_t));
+    switch (q_store_mode) {
+    case Q_STORE_INLINE:
+    case Q_STORE_ARENA:
+    case Q_STORE_INTERN:
+        q->store = q_store_mode;
+        break;
+    default:
+        q->store = Q_STORE_HEAP;
+    }
+    switch (q_key_mode) {
+    case Q_KEY_PACKED:
+    case Q_KEY_PREFIX:
+    case Q_KEY_FOLDED:
+        q->keys = q_key_mode;
+        break;
+    default:
+        q->keys = Q_KEY_NONE;
+    }
+    q->chunks = NULL;
+    q->arena_live = 0;
+    q->arena_dead = 0;
+    q->atoms = NULL;
+    q->atom_buckets = 0;
+    q->atom_count = 0;
+
+    /*
+     * Allocate the first slab up front, so that inserting into a fresh
+     * queue costs the same as inserting into a populated one.
+     */
+    q->slabs = NULL;
+    q->free_nodes = NULL;
+    if (q->store != Q_STORE_INLINE && !pool_grow(q, 0)) {
+        free(q);
+        return NULL;
+    }
     return q;
 }
 
@@ -27,15 +610,23 @@ void q_free(queue_t *q)
     if (!q)
         return;
 
-    /* Free the string inside the elements and the elements */
-    list_ele_t *curr = q->head;
-    while (curr) {
-        list_ele_t *next = curr->next;
-        free(curr->value);
-        free(curr);
-        curr = next;
+    /* Inline elements are standalone blocks reachable only through the list */
+    if (q->store == Q_STORE_INLINE) {
+        list_ele_t *curr = q->head;
+        while (curr) {
+            list_ele_t *next = curr->next;
+            free(curr);
+            curr = next;
+        }
     }
 
+    /* Release pooled elements a whole slab at a time */
+    slabs_destroy(q, q->slabs, q->store == Q_STORE_HEAP);
+
+    /* Arena strings go away with their chunks, atoms with their table */
+    arena_destroy(q->chunks, &q->bytes);
+    atoms_destroy(q);
+
     /* Free queue structure */
     free(q);
 }
@@ -52,22 +643,9 @@ bool q_insert_head(queue_t *q, char *s)
     if (!q)
         return false;
 
-    list_ele_t *newh = malloc(sizeof(list_ele_t));
+    list_ele_t *newh = ele_new(q, s, strlen(s));
     if (!newh)
         return false;
-    newh->next = NULL;
-
-    /* Don't forget to allocate space for the string and copy it */
-    /* What if either call to malloc returns NULL? */
-    size_t len = strlen(s) + 1;
-    newh->value = malloc(len);
-    if (!newh->value) {
-        free(newh);
-        return false;
-    }
-
-    /* Copy the string */
-    strncpy(newh->value, s, len);
 
     /* Concatenate the new element */
     if (!q->tail)
@@ -93,20 +671,9 @@ bool q_insert_tail(queue_t *q, char *s)
     if (!q)
         return false;
 
-    list_ele_t *newt = malloc(sizeof(list_ele_t));
+    list_ele_t *newt = ele_new(q, s, strlen(s));
     if (!newt)
         return false;
-    newt->next = NULL;
-
-    size_t len = strlen(s) + 1;
-    newt->value = malloc(len);
-    if (!newt->value) {
-        free(newt);
-        return false;
-    }
-
-    /* Copy the string */
-    strncpy(newt->value, s, len);
 
     /* Concatenate */
     if (!q->head)
@@ -120,6 +687,95 @@ bool q_insert_tail(queue_t *q, char *s)
     return true;
 }
 
+/*
+ * Insert the n strings of sp, of lengths lens if not NULL, at the head of
+ * queue q if at_head is set, or else at its tail.
+ * The elements are chained up first and spliced in at once.  Once the
+ * pool runs dry, it grows by a single slab holding all elements still to
+ * come, and arena queues reserve room for all strings up front.
+ * On failure the elements made so far are deleted again.
+ */
+static bool insert_bulk(queue_t *q,
+                        char **sp,
+                        const size_t *lens,
+                        size_t n,
+                        bool at_head)
+{
+    if (!q)
+        return false;
+    if (!n)
+        return true;
+
+    if (q->store == Q_STORE_ARENA) {
+        size_t total = 0;
+        for (size_t i = 0; i < n; i++)
+            total += (lens ? lens[i] : strlen(sp[i])) + 1;
+        struct CHUNK *c = q->chunks;
+        if ((!c || c->cap - c->used < total) &&
+            !arena_grow(&q->chunks, total, &q->bytes))
+            return false;
+    }
+
+    list_ele_t *first = NULL, *last = NULL;
+    bool ok = true;
+    for (size_t i = 0; ok && i < n; i++) {
+        bool room = q->store == Q_STORE_INLINE || q->free_nodes ||
+                    (q->slabs && q->slabs->used < q->slabs->cap) ||
+                    pool_grow(q, n - i);
+        list_ele_t *e =
+            room ? ele_new(q, sp[i], lens ? lens[i] : strlen(sp[i])) : NULL;
+        if (!e) {
+            ok = false;
+        } else if (at_head) {
+            /* Later strings go in front, as if inserted one by one */
+            e->next = first;
+            first = e;
+            if (!last)
+                last = e;
+        } else {
+            if (last)
+                last->next = e;
+            else
+                first = e;
+            last = e;
+        }
+    }
+
+    if (!ok) {
+        while (first) {
+            list_ele_t *next = first->next;
+            ele_delete(q, first);
+            first = next;
+        }
+        return false;
+    }
+
+    if (at_head) {
+        last->next = q->head;
+        q->head = first;
+        if (!q->tail)
+            q->tail = last;
+    } else {
+        if (q->tail)
+            q->tail->next = first;
+        else
+            q->head = first;
+        q->tail = last;
+    }
+    q->size += n;
+    return true;
+}
+
+bool q_insert_head_bulk(queue_t *q, char **sp, const size_t *lens, size_t n)
+{
+    return insert_bulk(q, sp, lens, n, true);
+}
+
+bool q_insert_tail_bulk(queue_t *q, char **sp, const size_t *lens, size_t n)
+{
+    return insert_bulk(q, sp, lens, n, false);
+}
+
 /*
  * Attempt to remove element from head of queue.
  * Return true if successful.
@@ -136,14 +792,17 @@ bool q_remove_head(queue_t *q, char *sp, size_t bufsize)
     list_ele_t *rm = q->head;
     q->head = q->head->next;
 
-    /* Copy the string when sp exists */
-    if (sp) {
-        strncpy(sp, rm->value, bufsize);
-        sp[bufsize - 1] = '\0';
+    /*
+     * Copy the string when sp exists.  Only the bytes of the string are
+     * written, not the rest of the buffer.
+     */
+    if (sp && bufsize) {
+        size_t n = rm->len < bufsize - 1 ? rm->len : bufsize - 1;
+        memcpy(sp, rm->value, n);
+        sp[n] = '\0';
     }
 
-    free(rm->value);
-    free(rm);
+    ele_delete(q, rm);
 
     /* When the elements in the list had all been removed */
     if (!q->head)
@@ -154,6 +813,138 @@ bool q_remove_head(queue_t *q, char *sp, size_t bufsize)
     return true;
 }
 
+/*
+ * A string with a block of its own is handed over as it is.  Inline and
+ * interned strings are moved to the front of their block, which is then
+ * handed over, so only strings sharing storage with others get copied.
+ */
+char *q_pop_head(queue_t *q)
+{
+    if (!q || !q->head)
+        return NULL;
+
+    list_ele_t *rm = q->head;
+    size_t len = rm->len + 1;
+    bool shared =
+        q->store == Q_STORE_ARENA ||
+        (q->store == Q_STORE_INTERN && atom_of(rm->value)->refcnt > 1);
+
+    /* Copy before unlinking, so failing leaves the queue as it was */
+    char *s = NULL;
+    if (shared) {
+        s = malloc(len);
+        if (!s)
+            return NULL;
+        memcpy(s, rm->value, len);
+    }
+
+    q->head = rm->next;
+    if (!q->head)
+        q->tail = NULL;
+    q->size--;
+
+    if (shared) {
+        ele_delete(q, rm);
+        return s;
+    }
+
+    switch (q->store) {
+    case Q_STORE_INLINE:
+        q->bytes -= block_bytes(ele_size(q) + len);
+        return memmove(rm, rm->value, len);
+    case Q_STORE_INTERN: {
+        struct ATOM *a = atom_of(rm->value);
+        atom_unlink(q, a, len);
+        ele_release(q, rm);
+        return memmove(a, a->str, len);
+    }
+    default:
+        s = rm->value;
+        q->bytes -= block_bytes(len);
+        ele_release(q, rm);
+        return s;
+    }
+}
+
+/*
+ * Return the string at head of queue, or NULL if q is NULL or empty
+ */
+const char *q_peek_head(queue_t *q)
+{
+    if (!q || !q->head)
+        return NULL;
+    return q->head->value;
+}
+
+/*
+ * The removed elements are unlinked in one walk.  Pooled ones still form
+ * a list when the walk ends, so they go back to the pool in one splice,
+ * and the arena is checked for holes once per batch.
+ */
+size_t q_remove_head_bulk(queue_t *q,
+                          size_t n,
+                          char *buf,
+                          size_t buflen,
+                          size_t *offsets)
+{
+    if (!q || (buf && !buflen))
+        return 0;
+
+    list_ele_t *first = q->head, *last = NULL, *e = first;
+    size_t cnt = 0, used = 0;
+    while (e && cnt < n) {
+        size_t len = e->len + 1;
+        if (buf) {
+            /* Only the first string may be truncated, so removal proceeds */
+            if (buflen - used < len && cnt)
+                break;
+            size_t copy = len < buflen ? len - 1 : buflen - 1;
+            memcpy(buf + used, e->value, copy);
+            buf[used + copy] = '\0';
+            if (offsets)
+                offsets[cnt] = used;
+            used += copy + 1;
+        }
+
+        list_ele_t *next = e->next;
+        switch (q->store) {
+        case Q_STORE_INLINE:
+            q->bytes -= block_bytes(ele_size(q) + len);
+            free(e);
+            break;
+        case Q_STORE_ARENA:
+            q->arena_live -= len;
+            q->arena_dead += len;
+            break;
+        case Q_STORE_INTERN:
+            atom_put(q, e->value, len);
+            break;
+        default:
+            q->bytes -= block_bytes(len);
+            free(e->value);
+        }
+        if (q->store != Q_STORE_INLINE) {
+            e->value = NULL;
+            last = e;
+        }
+        e = next;
+        cnt++;
+    }
+
+    q->head = e;
+    if (!e)
+        q->tail = NULL;
+    q->size -= cnt;
+
+    if (last) {
+        last->next = q->free_nodes;
+        q->free_nodes = first;
+    }
+    if (q->store == Q_STORE_ARENA)
+        arena_reclaim(q);
+    return cnt;
+}
+
 /*
  * Return number of elements in queue.
  * Return 0 if q is NULL or empty
@@ -166,6 +957,63 @@ int q_size(queue_t *q)
     return q->size;
 }
 
+/*
+ * Return number of bytes held by queue: the queue structure, the node
+ * pool, and the string storage, including the per-block overhead of a
+ * typical malloc.
+ * Return 0 if q is NULL
+ */
+size_t q_footprint(queue_t *q)
+{
+    if (!q)
+        return 0;
+    return q->bytes;
+}
+
+/*
+ * Move the elements of queue into one slab, laid out in list order, so
+ * that walking the list touches memory sequentially.  Strings kept in the
+ * arena are rewritten in list order as well.
+ * Return true if successful.
+ * Return false if q is NULL or could not allocate space, in which case
+ * the queue is left as it was.
+ * Has no effect on Q_STORE_INLINE queues, whose elements are not pooled.
+ */
+bool q_compact(queue_t *q)
+{
+    if (!q)
+        return false;
+    if (q->store == Q_STORE_INLINE || !q->head)
+        return true;
+
+    size_t cap = q->size > SLAB_MIN_NODES ? q->size : SLAB_MIN_NODES;
+    struct SLAB *slab = slab_new(q, cap);
+    if (!slab)
+        return false;
+
+    /* Copy the elements in list order, linking each copy to the next one */
+    size_t size = ele_size(q);
+    list_ele_t *prev = NULL;
+    for (list_ele_t *e = q->head; e; e = e->next) {
+        list_ele_t *copy = slab_node(slab, slab->used++, size);
+        memcpy(copy, e, size);
+        if (prev)
+            prev->next = copy;
+        prev = copy;
+    }
+    q->head = slab_node(slab, 0, size);
+    q->tail = prev;
+
+    /* The old slabs no longer hold any live element */
+    slabs_destroy(q, q->slabs, false);
+    q->slabs = slab;
+    q->free_nodes = NULL;
+
+    if (q->store == Q_STORE_ARENA)
+        arena_compact(q);
+    return true;
+}
+
 /*
  * Reverse elements in queue
  * No effect if q is NULL or empty
@@ -204,79 +1052,992 @@ void q_reverse(queue_t *q)
  * element, do nothing.
  */
 
-static list_ele_t *merge_list(list_ele_t *l1, list_ele_t *l2)
+size_t q_sort_compares;
+size_t q_sort_fallbacks;
+
+/* Comparisons made by the current thread, added up by q_sort */
+static __thread size_t sort_compares, sort_fallbacks;
+
+/* Key mode of the queue being sorted */
+static q_key_t sort_keys;
+
+/*
+ * Compare the strings of two elements like strcmp.
+ * When both elements carry packed keys, the keys decide on their own.
+ * Different prefix keys decide too, and equal ones leave only the bytes
+ * after the prefix to compare, if the strings are that long at all.
+ * Otherwise including the shorter terminator stops the comparison at the
+ * end of the shorter string.
+ */
+static inline int ele_cmp(const list_ele_t *a, const list_ele_t *b)
 {
-    if (!l2)
-        return l1;
-    if (!l1)
-        return l2;
+    size_t skip = 0;
 
-    list_ele_t *curr, *head;
+    sort_compares++;
+    switch (sort_keys) {
+    case Q_KEY_PACKED:
+        if (!((ele_key(a) | ele_key(b)) & KEY_UNPACKED))
+            return (ele_key(a) > ele_key(b)) - (ele_key(a) < ele_key(b));
+        break;
+    case Q_KEY_PREFIX:
+        if (ele_key(a) != ele_key(b))
+            return ele_key(a) > ele_key(b) ? 1 : -1;
+        if (a->len < KEY_PREFIX_CHARS)
+            return 0;
+        skip = KEY_PREFIX_CHARS;
+        break;
+    default:
+        break;
+    }
 
-    if (strcmp(l1->value, l2->value) < 0) {
-        head = l1;
-        l1 = l1->next;
-    } else {
-        head = l2;
-        l2 = l2->next;
+    sort_fallbacks++;
+    size_t n = a->len < b->len ? a->len : b->len;
+    return memcmp(a->value + skip, b->value + skip, n + 1 - skip);
+}
+
+/* Compare like ele_cmp, the other way round */
+static inline int ele_cmp_descending(const list_ele_t *a, const list_ele_t *b)
+{
+    return ele_cmp(b, a);
+}
+
+/*
+ * Compare the strings of two elements like strcasecmp.
+ * Folded keys decide like prefix keys do in ele_cmp.
+ */
+static inline int ele_cmp_nocase(const list_ele_t *a, const list_ele_t *b)
+{
+    size_t skip = 0;
+
+    sort_compares++;
+    if (sort_keys == Q_KEY_FOLDED) {
+        if (ele_key(a) != ele_key(b))
+            return ele_key(a) > ele_key(b) ? 1 : -1;
+        if (a->len < KEY_PREFIX_CHARS)
+            return 0;
+        skip = KEY_PREFIX_CHARS;
     }
 
-    curr = head;
+    sort_fallbacks++;
+    return strcasecmp(a->value + skip, b->value + skip);
+}
 
-    while (l1 && l2) {
-        if (strcmp(l1->value, l2->value) < 0) {
-            curr->next = l1;
-            l1 = l1->next;
-        } else {
-            curr->next = l2;
-            l2 = l2->next;
+/*
+ * Compare strings a and b like strcmp, except that sequences of digits
+ * compare by their numeric value, so "file9" goes before "file10".
+ * Sequences differing only in leading zeros are equal.
+ */
+static int natural_cmp(const char *a, const char *b)
+{
+    while (*a && *b) {
+        if (!isdigit((unsigned char) *a) || !isdigit((unsigned char) *b)) {
+            if (*a != *b)
+                break;
+            a++;
+            b++;
+            continue;
         }
-        curr = curr->next;
+
+        /* Without leading zeros, longer numbers are larger */
+        while (*a == '0')
+            a++;
+        while (*b == '0')
+            b++;
+        size_t na = 0, nb = 0;
+        while (isdigit((unsigned char) a[na]))
+            na++;
+        while (isdigit((unsigned char) b[nb]))
+            nb++;
+        if (na != nb)
+            return na < nb ? -1 : 1;
+        int cmp = memcmp(a, b, na);
+        if (cmp)
+            return cmp;
+        a += na;
+        b += nb;
     }
+    return (unsigned char) *a - (unsigned char) *b;
+}
 
-    if (l1)
-        curr->next = l1;
-    if (l2)
-        curr->next = l2;
+static inline int ele_cmp_natural(const list_ele_t *a, const list_ele_t *b)
+{
+    sort_compares++;
+    sort_fallbacks++;
+    return natural_cmp(a->value, b->value);
+}
 
-    return head;
+/* Order shorter strings first, and strings of equal length like strcmp */
+static inline int ele_cmp_length(const list_ele_t *a, const list_ele_t *b)
+{
+    sort_compares++;
+    if (a->len != b->len)
+        return a->len < b->len ? -1 : 1;
+    sort_fallbacks++;
+    return memcmp(a->value, b->value, a->len);
 }
 
-static list_ele_t *sort_list(list_ele_t *head)
+/*
+ * Number of consecutive elements one run has to win during a merge before
+ * the merge starts galloping through it
+ */
+#define MIN_GALLOP 7
+
+/*
+ * Most runs a sort can have pending.  The merge policy keeps pending run
+ * lengths growing at least like Fibonacci numbers, far fewer than this.
+ */
+#define MAX_PENDING 128
+
+/* Sorted sublist, carrying its tail so that it never has to be walked */
+typedef struct {
+    list_ele_t *head, *tail;
+    size_t len;
+} run_t;
+
+/* Arrays this short are sorted by insertion */
+#define ARRAY_INSERTION_MAX 16
+
+/*
+ * Define the list and array sorts for one order, given the function
+ * comparing two elements in that order.  Each order thus gets merge
+ * loops of its own, with the comparison inlined rather than called
+ * through a pointer.
+ */
+#define DEFINE_SORT(order, compare)                                           \
+/* Whether element e goes before pivot, or ties with it when ties is set */   \
+static inline bool ele_before_##order(const list_ele_t *e,                    \
+                                      const list_ele_t *pivot,                \
+                                      bool ties)                              \
+{                                                                             \
+    int cmp = compare(e, pivot);                                              \
+    return ties ? cmp <= 0 : cmp < 0;                                         \
+}                                                                             \
+                                                                              \
+/*                                                                            \
+ * Return the last element of the longest prefix of list x whose elements     \
+ * all go before pivot, or NULL if x itself does not.                         \
+ * Elements are probed at exponentially growing distances and the final       \
+ * gap is binary searched, so a prefix of k elements takes O(log k)           \
+ * comparisons.                                                               \
+ */                                                                           \
+static list_ele_t *gallop_##order(list_ele_t *x,                              \
+                                  const list_ele_t *pivot,                    \
+                                  bool ties)                                  \
+{                                                                             \
+    if (!ele_before_##order(x, pivot, ties))                                  \
+        return NULL;                                                          \
+                                                                              \
+    list_ele_t *last = x;                                                     \
+    for (size_t step = 1;; step <<= 1) {                                      \
+        list_ele_t *probe = last;                                             \
+        size_t n = 0;                                                         \
+        while (n < step && probe->next) {                                     \
+            probe = probe->next;                                              \
+            n++;                                                              \
+        }                                                                     \
+        if (!n)                                                               \
+            return last;                                                      \
+        if (ele_before_##order(probe, pivot, ties)) {                         \
+            last = probe;                                                     \
+            if (n < step)                                                     \
+                return last;                                                  \
+            continue;                                                         \
+        }                                                                     \
+                                                                              \
+        /* The prefix ends among the n - 1 elements between last and probe */ \
+        size_t count = n - 1;                                                 \
+        while (count) {                                                       \
+            size_t half = (count + 1) / 2;                                    \
+            list_ele_t *mid = last;                                           \
+            for (size_t i = 0; i < half; i++)                                 \
+                mid = mid->next;                                              \
+            if (ele_before_##order(mid, pivot, ties)) {                       \
+                last = mid;                                                   \
+                count -= half;                                                \
+            } else {                                                          \
+                count = half - 1;                                             \
+            }                                                                 \
+        }                                                                     \
+        return last;                                                          \
+    }                                                                         \
+}                                                                             \
+                                                                              \
+/*                                                                            \
+ * Merge sorted runs l1 and l2 into one sorted run.                           \
+ * Elements of l1 come first among equal strings, keeping the sort stable.    \
+ * Once a run wins MIN_GALLOP times in a row, the merge gallops through it    \
+ * to take its whole winning stretch at once.                                 \
+ */                                                                           \
+static run_t merge_list_##order(run_t l1, run_t l2)                           \
+{                                                                             \
+    run_t merged = {.len = l1.len + l2.len};                                  \
+                                                                              \
+    /* Runs already in order, either way round, are joined without merging */ \
+    if (compare(l1.tail, l2.head) <= 0) {                                     \
+        l1.tail->next = l2.head;                                              \
+        merged.head = l1.head;                                                \
+        merged.tail = l2.tail;                                                \
+        return merged;                                                        \
+    }                                                                         \
+    if (compare(l2.tail, l1.head) < 0) {                                      \
+        l2.tail->next = l1.head;                                              \
+        merged.head = l2.head;                                                \
+        merged.tail = l1.tail;                                                \
+        return merged;                                                        \
+    }                                                                         \
+                                                                              \
+    list_ele_t **p = &merged.head;                                            \
+    list_ele_t *a = l1.head, *b = l2.head;                                    \
+    int wins_a = 0, wins_b = 0;                                               \
+                                                                              \
+    while (a && b) {                                                          \
+        if (compare(a, b) <= 0) {                                             \
+            *p = a;                                                           \
+            p = &a->next;                                                     \
+            a = a->next;                                                      \
+            wins_a++;                                                         \
+            wins_b = 0;                                                       \
+        } else {                                                              \
+            *p = b;                                                           \
+            p = &b->next;                                                     \
+            b = b->next;                                                      \
+            wins_b++;                                                         \
+            wins_a = 0;                                                       \
+        }                                                                     \
+                                                                              \
+        if (!a || !b)                                                         \
+            break;                                                            \
+        if (wins_a >= MIN_GALLOP) {                                           \
+            list_ele_t *last = gallop_##order(a, b, true);                    \
+            if (last) {                                                       \
+                *p = a;                                                       \
+                p = &last->next;                                              \
+                a = last->next;                                               \
+            }                                                                 \
+            wins_a = 0;                                                       \
+        } else if (wins_b >= MIN_GALLOP) {                                    \
+            list_ele_t *last = gallop_##order(b, a, false);                   \
+            if (last) {                                                       \
+                *p = b;                                                       \
+                p = &last->next;                                              \
+                b = last->next;                                               \
+            }                                                                 \
+            wins_b = 0;                                                       \
+        }                                                                     \
+    }                                                                         \
+                                                                              \
+    /* Whatever is left over ends the merged run */                           \
+    if (a) {                                                                  \
+        *p = a;                                                               \
+        merged.tail = l1.tail;                                                \
+    } else {                                                                  \
+        *p = b;                                                               \
+        merged.tail = l2.tail;                                                \
+    }                                                                         \
+    return merged;                                                            \
+}                                                                             \
+                                                                              \
+/*                                                                            \
+ * Detach the natural run at the start of list head, leaving the rest of      \
+ * the list in *rest.                                                         \
+ * A run is either non-descending or strictly descending.  Descending runs    \
+ * are reversed in place; having no equal elements, they stay stable.         \
+ */                                                                           \
+static run_t find_run_##order(list_ele_t *head, list_ele_t **rest)            \
+{                                                                             \
+    run_t run = {head, head, 1};                                              \
+    list_ele_t *next = head->next;                                            \
+                                                                              \
+    if (next && compare(head, next) > 0) {                                    \
+        while (next && compare(run.head, next) > 0) {                         \
+            list_ele_t *after = next->next;                                   \
+            next->next = run.head;                                            \
+            run.head = next;                                                  \
+            run.len++;                                                        \
+            next = after;                                                     \
+        }                                                                     \
+    } else {                                                                  \
+        while (next && compare(run.tail, next) <= 0) {                        \
+            run.tail = next;                                                  \
+            run.len++;                                                        \
+            next = next->next;                                                \
+        }                                                                     \
+    }                                                                         \
+                                                                              \
+    run.tail->next = NULL;                                                    \
+    *rest = next;                                                             \
+    return run;                                                               \
+}                                                                             \
+                                                                              \
+/*                                                                            \
+ * Merge pending runs until their lengths satisfy the invariants of           \
+ * Timsort: reading from the top of the stack, each run is shorter than       \
+ * the one below it, and shorter than the sum of the two below that.          \
+ * Merges thus stay balanced and at most O(log n) runs are pending.           \
+ * Return the new number of pending runs.                                     \
+ */                                                                           \
+static size_t merge_collapse_##order(run_t *stack, size_t n)                  \
+{                                                                             \
+    while (n > 1) {                                                           \
+        size_t k = n - 2;                                                     \
+        if ((k > 0 && stack[k - 1].len <= stack[k].len + stack[k + 1].len) || \
+            (k > 1 && stack[k - 2].len <= stack[k - 1].len + stack[k].len)) { \
+            if (stack[k - 1].len < stack[k + 1].len)                          \
+                k--;                                                          \
+        } else if (stack[k].len > stack[k + 1].len) {                         \
+            break;                                                            \
+        }                                                                     \
+                                                                              \
+        stack[k] = merge_list_##order(stack[k], stack[k + 1]);                \
+        if (k + 2 < n)                                                        \
+            stack[k + 1] = stack[k + 2];                                      \
+        n--;                                                                  \
+    }                                                                         \
+    return n;                                                                 \
+}                                                                             \
+                                                                              \
+/*                                                                            \
+ * Sort the list starting at head without recursion, as a natural merge       \
+ * sort.  The list is cut into its existing runs, which are merged as         \
+ * they are found, so sorted or reversed input takes linear time.             \
+ */                                                                           \
+static run_t sort_list_##order(list_ele_t *head)                              \
+{                                                                             \
+    run_t stack[MAX_PENDING];                                                 \
+    size_t n = 0;                                                             \
+                                                                              \
+    while (head) {                                                            \
+        stack[n++] = find_run_##order(head, &head);                           \
+        n = merge_collapse_##order(stack, n);                                 \
+    }                                                                         \
+                                                                              \
+    /* Fold the pending runs together, newest first */                        \
+    while (n > 1) {                                                           \
+        stack[n - 2] = merge_list_##order(stack[n - 2], stack[n - 1]);        \
+        n--;                                                                  \
+    }                                                                         \
+    return stack[0];                                                          \
+}                                                                             \
+                                                                              \
+/*                                                                            \
+ * Stable merge sort of the n element pointers in a, using as many in tmp     \
+ * as temporary space                                                         \
+ */                                                                           \
+static void sort_array_##order(list_ele_t **a, list_ele_t **tmp, size_t n)    \
+{                                                                             \
+    if (n <= ARRAY_INSERTION_MAX) {                                           \
+        for (size_t i = 1; i < n; i++) {                                      \
+            list_ele_t *e = a[i];                                             \
+            size_t j = i;                                                     \
+            for (; j > 0 && compare(a[j - 1], e) > 0; j--)                    \
+                a[j] = a[j - 1];                                              \
+            a[j] = e;                                                         \
+        }                                                                     \
+        return;                                                               \
+    }                                                                         \
+                                                                              \
+    size_t mid = n / 2;                                                       \
+    sort_array_##order(a, tmp, mid);                                          \
+    sort_array_##order(a + mid, tmp + mid, n - mid);                          \
+    if (compare(a[mid - 1], a[mid]) <= 0)                                     \
+        return;                                                               \
+                                                                              \
+    /* Merge the left half, moved out of the way, with the right one */       \
+    memcpy(tmp, a, mid * sizeof(list_ele_t *));                               \
+    size_t i = 0, j = mid, k = 0;                                             \
+    while (i < mid && j < n)                                                  \
+        a[k++] = compare(tmp[i], a[j]) <= 0 ? tmp[i++] : a[j++];              \
+    while (i < mid)                                                           \
+        a[k++] = tmp[i++];                                                    \
+}
+
+DEFINE_SORT(ascending, ele_cmp)
+DEFINE_SORT(descending, ele_cmp_descending)
+DEFINE_SORT(nocase, ele_cmp_nocase)
+DEFINE_SORT(natural, ele_cmp_natural)
+DEFINE_SORT(length, ele_cmp_length)
+
+/* Sorts generated for one order */
+typedef struct {
+    run_t (*sort_list)(list_ele_t *head);
+    run_t (*merge_list)(run_t l1, run_t l2);
+    void (*sort_array)(list_ele_t **a, list_ele_t **tmp, size_t n);
+} sort_ops_t;
+
+#define SORT_OPS(order) \
+    {sort_list_##order, merge_list_##order, sort_array_##order}
+
+/* Sorts for each order, indexed by q_order_t */
+static const sort_ops_t order_sorts[] = {
+    [Q_ORDER_ASCENDING] = SORT_OPS(ascending),
+    [Q_ORDER_DESCENDING] = SORT_OPS(descending),
+    [Q_ORDER_NOCASE] = SORT_OPS(nocase),
+    [Q_ORDER_NATURAL] = SORT_OPS(natural),
+    [Q_ORDER_LENGTH] = SORT_OPS(length),
+};
+
+/* Sorts for the order of the sort in progress */
+static const sort_ops_t *sort_ops;
+
+/* Sort algorithm used by q_sort */
+int q_sort_algo = Q_SORT_MERGE;
+
+/* Buckets with fewer elements than this are merge sorted instead */
+#define RADIX_CUTOFF 32
+
+/* Deepest string position radix sorted before falling back to merging */
+#define RADIX_MAX_DEPTH 64
+
+/* Byte at position depth of the string of e, 0 past its end */
+static inline unsigned char ele_byte(const list_ele_t *e, size_t depth)
 {
-    if (!head || !head->next)
-        return head;
+    /* Prefix keys spare loading the string for its leading bytes */
+    if (sort_keys == Q_KEY_PREFIX && depth < KEY_PREFIX_CHARS)
+        return ele_key(e) >> (8 * (KEY_PREFIX_CHARS - 1 - depth));
+    return depth < e->len ? (unsigned char) e->value[depth] : 0;
+}
 
-    /* Split the list into 2 parts */
-    list_ele_t *fast = head->next;
-    list_ele_t *slow = head;
+/*
+ * Sort the list of n elements starting at head, all of whose strings
+ * share their first depth bytes, as an MSD radix sort.
+ * Elements are distributed over one bucket per byte value found at
+ * position depth, with strings that end before it in bucket 0.  Each
+ * bucket is then sorted on the following bytes, except for bucket 0,
+ * whose strings are all equal.  Distribution preserves the order of the
+ * elements, so the sort is stable and orders strings like strcmp.
+ */
+static run_t radix_sort(list_ele_t *head, size_t n, size_t depth)
+{
+    if (n < RADIX_CUTOFF || depth >= RADIX_MAX_DEPTH)
+        return sort_list_ascending(head);
 
-    while (fast && fast->next) {
-        slow = slow->next;
-        fast = fast->next->next;
+    run_t buckets[256];
+    for (size_t c = 0; c < 256; c++) {
+        buckets[c].head = NULL;
+        buckets[c].len = 0;
     }
-    fast = slow->next;
-    slow->next = NULL;
 
-    /* split each list */
-    list_ele_t *l1 = sort_list(head);
-    list_ele_t *l2 = sort_list(fast);
+    while (head) {
+        list_ele_t *e = head;
+        head = head->next;
+        e->next = NULL;
+
+        run_t *b = &buckets[ele_byte(e, depth)];
+        if (b->head)
+            b->tail->next = e;
+        else
+            b->head = e;
+        b->tail = e;
+        b->len++;
+    }
 
-    /* merge and sort l1 and l2 */
-    return merge_list(l1, l2);
+    /* Sort the buckets and chain them in byte order */
+    run_t sorted = {NULL, NULL, 0};
+    list_ele_t **p = &sorted.head;
+    for (size_t c = 0; c < 256; c++) {
+        if (!buckets[c].head)
+            continue;
+        run_t b = c ? radix_sort(buckets[c].head, buckets[c].len, depth + 1)
+                    : buckets[c];
+        *p = b.head;
+        p = &b.tail->next;
+        sorted.tail = b.tail;
+        sorted.len += b.len;
+    }
+    return sorted;
 }
 
-void q_sort(queue_t *q)
+/*
+ * Sort the list of n elements starting at head by gathering pointers to
+ * its elements into buf, which has room for 2 * n of them, sorting those
+ * and relinking the elements in one sequential pass.
+ */
+static run_t array_sort(list_ele_t *head, size_t n, list_ele_t **buf)
 {
+    for (size_t i = 0; i < n; i++) {
+        buf[i] = head;
+        head = head->next;
+    }
+    sort_ops->sort_array(buf, buf + n, n);
+
+    for (size_t i = 0; i + 1 < n; i++)
+        buf[i]->next = buf[i + 1];
+    buf[n - 1]->next = NULL;
+
+    run_t sorted = {buf[0], buf[n - 1], n};
+    return sorted;
+}
+
+/*
+ * Sort the list of n elements starting at head with the chosen algorithm.
+ * buf is the scratch space of an array sort, without which the list is
+ * merge sorted instead.
+ */
+static run_t sort_run(list_ele_t *head, size_t n, list_ele_t **buf)
+{
+    if (q_sort_algo == Q_SORT_ARRAY && buf)
+        return array_sort(head, n, buf);
+    /* Radix sorts only know the byte order of ascending sorts */
+    if (q_sort_algo == Q_SORT_RADIX && sort_ops == &order_sorts[0])
+        return radix_sort(head, n, 0);
+    return sort_ops->sort_list(head);
+}
+
+/* Most threads q_sort may use, 1 to sort on the calling thread only */
+int q_sort_threads = 1;
+
+/* Fewest elements worth sorting on a thread of their own */
+#define PARALLEL_MIN_RUN 32768
+
+/* Most threads a single sort uses */
+#define PARALLEL_MAX_THREADS 64
+
+/* Part of a parallel sort: sort run, or merge other into it if not empty */
+typedef struct {
+    run_t run, other;
+    list_ele_t **buf; /* Scratch space for sorting run, or NULL */
+    pthread_t thread;
+    bool threaded; /* Whether the job runs on a thread of its own */
+    size_t compares, fallbacks;
+} sort_job_t;
+
+static void *sort_job(void *arg)
+{
+    sort_job_t *job = arg;
+
+    if (job->other.head)
+        job->run = sort_ops->merge_list(job->run, job->other);
+    else
+        job->run = sort_run(job->run.head, job->run.len, job->buf);
+    job->compares = sort_compares;
+    job->fallbacks = sort_fallbacks;
+    return NULL;
+}
+
+/*
+ * Run n jobs at once, all but the first on threads of their own.
+ * Jobs whose thread could not be started run on the calling thread.
+ * SIGALRM is held back until every thread has been joined, so a time
+ * limit running out cannot jump away while threads still relink the
+ * list; the sort is then interrupted between two rounds of jobs.
+ */
+static void run_jobs(sort_job_t *jobs, size_t n)
+{
+    sigset_t all, held, old;
+
+    /* Leave the signals qtest handles, such as its alarm, to this thread */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    for (size_t i = 1; i < n; i++)
+        jobs[i].threaded =
+            !pthread_create(&jobs[i].thread, NULL, sort_job, &jobs[i]);
+    held = old;
+    sigaddset(&held, SIGALRM);
+    pthread_sigmask(SIG_SETMASK, &held, NULL);
+
+    for (size_t i = 0; i < n; i++) {
+        if (!jobs[i].threaded)
+            sort_job(&jobs[i]);
+    }
+    for (size_t i = 1; i < n; i++) {
+        if (!jobs[i].threaded)
+            continue;
+        pthread_join(jobs[i].thread, NULL);
+        q_sort_compares += jobs[i].compares;
+        q_sort_fallbacks += jobs[i].fallbacks;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/*
+ * Sort the list of n elements starting at head on nthreads threads.
+ * The list is cut into one piece per thread and the pieces are sorted at
+ * once, each with its share of the scratch space buf, if any.
+ * Neighbouring pieces are then merged pairwise, which halves the number
+ * of busy threads in each round and keeps the sort stable.
+ */
+static run_t parallel_sort(list_ele_t *head,
+                           size_t n,
+                           size_t nthreads,
+                           list_ele_t **buf)
+{
+    sort_job_t jobs[PARALLEL_MAX_THREADS];
+
+    for (size_t i = 0; i < nthreads; i++) {
+        size_t len = n / nthreads + (i < n % nthreads);
+        jobs[i].run.head = head;
+        jobs[i].run.len = len;
+        jobs[i].other.head = NULL;
+        jobs[i].buf = buf;
+        jobs[i].threaded = false;
+        if (buf)
+            buf += 2 * len;
+
+        /* Cut the piece off the rest of the list */
+        for (size_t j = 1; j < len; j++)
+            head = head->next;
+        list_ele_t *last = head;
+        head = head->next;
+        last->next = NULL;
+    }
+    run_jobs(jobs, nthreads);
+
+    for (size_t pieces = nthreads; pieces > 1; pieces = (pieces + 1) / 2) {
+        size_t pairs = pieces / 2;
+        for (size_t i = 0; i < pairs; i++) {
+            jobs[i].run = jobs[2 * i].run;
+            jobs[i].other = jobs[2 * i + 1].run;
+            jobs[i].threaded = false;
+        }
+        run_jobs(jobs, pairs);
+
+        /* An odd piece out waits for the next round */
+        if (pieces % 2)
+            jobs[pairs].run = jobs[pieces - 1].run;
+    }
+    return jobs[0].run;
+}
+
+void q_sort_by(queue_t *q, q_order_t order)
+{
+    q_sort_compares = 0;
+    q_sort_fallbacks = 0;
     if (!q || q->size <= 1)
         return;
 
-    /* Sort the list */
-    q->head = sort_list(q->head);
+    sort_ops = &order_sorts[order <= Q_ORDER_LENGTH ? order : 0];
+    sort_keys = q->keys;
+    sort_compares = 0;
+    sort_fallbacks = 0;
 
-    /* Update the new tail */
-    list_ele_t *newt = q->head;
-    while (newt->next)
-        newt = newt->next;
-    q->tail = newt;
+    /* Give each thread enough elements to be worth starting it */
+    size_t nthreads = q_sort_threads > 1 ? q_sort_threads : 1;
+    if (nthreads > q->size / PARALLEL_MIN_RUN)
+        nthreads = q->size / PARALLEL_MIN_RUN;
+    if (nthreads > PARALLEL_MAX_THREADS)
+        nthreads = PARALLEL_MAX_THREADS;
+
+    /* Array sorts need room for two pointers per element */
+    list_ele_t **buf = NULL;
+    if (q_sort_algo == Q_SORT_ARRAY)
+        buf = test_scratch(2 * q->size * sizeof(list_ele_t *));
+
+    /* Sort the list, which also finds the new tail */
+    run_t sorted = nthreads > 1
+                       ? parallel_sort(q->head, q->size, nthreads, buf)
+                       : sort_run(q->head, q->size, buf);
+    test_scratch_release(buf);
+    q_sort_compares += sort_compares;
+    q_sort_fallbacks += sort_fallbacks;
+    q->head = sorted.head;
+    q->tail = sorted.tail;
+}
+
+void q_sort(queue_t *q)
+{
+    q_sort_by(q, Q_ORDER_ASCENDING);
+}
+
+/*
+ * Let element heap[i] sink until the n elements of heap form a max-heap
+ * again, given that both subtrees below it already do
+ */
+static void heap_sift_down(list_ele_t **heap, size_t n, size_t i)
+{
+    list_ele_t *e = heap[i];
+
+    for (;;) {
+        size_t child = 2 * i + 1;
+        if (child >= n)
+            break;
+        if (child + 1 < n && ele_cmp(heap[child + 1], heap[child]) > 0)
+            child++;
+        if (ele_cmp(heap[child], e) <= 0)
+            break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = e;
+}
+
+/*
+ * The k smallest elements seen so far are kept in a max-heap, so each
+ * further element only needs comparing with the largest of them, and
+ * displacing it takes O(log k) comparisons.
+ */
+void q_sort_k(queue_t *q, size_t k)
+{
+    q_sort_compares = 0;
+    q_sort_fallbacks = 0;
+    if (!q || !k)
+        return;
+    if (k >= q->size) {
+        q_sort(q);
+        return;
+    }
+
+    list_ele_t **heap = test_scratch(k * sizeof(list_ele_t *));
+    if (!heap) {
+        q_sort(q);
+        return;
+    }
+
+    sort_keys = q->keys;
+    sort_compares = 0;
+    sort_fallbacks = 0;
+
+    list_ele_t *e = q->head;
+    for (size_t i = 0; i < k; i++) {
+        heap[i] = e;
+        e = e->next;
+    }
+    for (size_t i = k / 2; i-- > 0;)
+        heap_sift_down(heap, k, i);
+
+    /* Elements not kept, either passed over or displaced, follow the heap */
+    list_ele_t *rest = NULL, **p = &rest;
+    while (e) {
+        list_ele_t *next = e->next;
+        list_ele_t *out = e;
+        if (ele_cmp(e, heap[0]) < 0) {
+            out = heap[0];
+            heap[0] = e;
+            heap_sift_down(heap, k, 0);
+        }
+        *p = out;
+        p = &out->next;
+        q->tail = out;
+        e = next;
+    }
+    *p = NULL;
+
+    /* Heapsort the kept elements in place and chain them in front */
+    for (size_t n = k - 1; n > 0; n--) {
+        list_ele_t *max = heap[0];
+        heap[0] = heap[n];
+        heap[n] = max;
+        heap_sift_down(heap, n, 0);
+    }
+    for (size_t i = 0; i + 1 < k; i++)
+        heap[i]->next = heap[i + 1];
+    heap[k - 1]->next = rest;
+    q->head = heap[0];
+
+    test_scratch_release(heap);
+    q_sort_compares = sort_compares;
+    q_sort_fallbacks = sort_fallbacks;
+}
+
+/*
+ * Hand all storage of queue src over to queue q, which takes ownership
+ * of the elements of src.  Both queues must store strings the same way.
+ * The list of src is left empty, and nothing is allocated or freed.
+ */
+static void queue_absorb(queue_t *q, queue_t *src)
+{
+    size_t moved = src->bytes - block_bytes(sizeof(queue_t));
+
+    /*
+     * Only the lists of src are walked, so absorbing costs nothing in the
+     * size of q.  Slabs and chunks of src go right after the first ones
+     * of q, which q keeps filling; recycled elements go in front.
+     */
+    if (src->slabs) {
+        struct SLAB *last = src->slabs;
+        while (last->next)
+            last = last->next;
+        if (q->slabs) {
+            last->next = q->slabs->next;
+            q->slabs->next = src->slabs;
+        } else {
+            q->slabs = src->slabs;
+        }
+        src->slabs = NULL;
+    }
+
+    if (src->free_nodes) {
+        list_ele_t *last = src->free_nodes;
+        while (last->next)
+            last = last->next;
+        last->next = q->free_nodes;
+        q->free_nodes = src->free_nodes;
+        src->free_nodes = NULL;
+    }
+
+    if (src->chunks) {
+        struct CHUNK *last = src->chunks;
+        while (last->next)
+            last = last->next;
+        if (q->chunks) {
+            last->next = q->chunks->next;
+            q->chunks->next = src->chunks;
+        } else {
+            q->chunks = src->chunks;
+        }
+        src->chunks = NULL;
+    }
+    q->arena_live += src->arena_live;
+    q->arena_dead += src->arena_dead;
+    src->arena_live = 0;
+    src->arena_dead = 0;
+
+    /*
+     * Atoms move into the buckets of q, whose load factor may then exceed
+     * one until it next grows.  Strings interned by both queues stay in
+     * two atoms, each still counting its own references.
+     */
+    if (!q->atoms) {
+        q->atoms = src->atoms;
+        q->atom_buckets = src->atom_buckets;
+        src->atoms = NULL;
+        src->atom_buckets = 0;
+    } else if (src->atoms) {
+        moved -= block_bytes(src->atom_buckets * sizeof(struct ATOM *));
+        for (size_t i = 0; i < src->atom_buckets; i++) {
+            struct ATOM *a = src->atoms[i];
+            while (a) {
+                struct ATOM *next = a->next;
+                a->next = q->atoms[a->hash & (q->atom_buckets - 1)];
+                q->atoms[a->hash & (q->atom_buckets - 1)] = a;
+                a = next;
+            }
+            src->atoms[i] = NULL;
+        }
+    }
+    q->atom_count += src->atom_count;
+    src->atom_count = 0;
+
+    q->bytes += moved;
+    src->bytes -= moved;
+    src->head = src->tail = NULL;
+    src->size = 0;
+}
+
+/*
+ * Each queue is pushed as one run on the pending stack of a natural merge
+ * sort, whose merge policy keeps the merges balanced, so merging k queues
+ * of n elements in total takes O(n log k) comparisons.
+ */
+bool q_merge(queue_t **qs, int k)
+{
+    if (!qs || k < 1 || !qs[0])
+        return false;
+
+    queue_t *q = qs[0];
+    for (int i = 1; i < k; i++) {
+        if (qs[i] && (qs[i]->store != q->store || qs[i]->keys != q->keys))
+            return false;
+    }
+
+    sort_keys = q->keys;
+    sort_compares = 0;
+    sort_fallbacks = 0;
+
+    run_t stack[MAX_PENDING];
+    size_t n = 0;
+    for (int i = 0; i < k; i++) {
+        queue_t *src = qs[i];
+        if (!src || (i > 0 && src == q))
+            continue;
+
+        if (src->head) {
+            run_t run = {src->head, src->tail, src->size};
+            stack[n++] = run;
+            n = merge_collapse_ascending(stack, n);
+        }
+        if (src != q)
+            queue_absorb(q, src);
+    }
+    while (n > 1) {
+        stack[n - 2] = merge_list_ascending(stack[n - 2], stack[n - 1]);
+        n--;
+    }
+
+    q->head = n ? stack[0].head : NULL;
+    q->tail = n ? stack[0].tail : NULL;
+    q->size = n ? stack[0].len : 0;
+    q_sort_compares = sort_compares;
+    q_sort_fallbacks = sort_fallbacks;
+    return true;
+}
+
+/* Whether elements a and b, with keys of the given kind, hold equal strings */
+static inline bool ele_equal(const list_ele_t *a,
+                             const list_ele_t *b,
+                             q_key_t keys)
+{
+    /* Equal strings have equal keys, in whichever key mode */
+    return a->value == b->value ||
+           (a->len == b->len &&
+            (keys == Q_KEY_NONE || ele_key(a) == ele_key(b)) &&
+            !memcmp(a->value, b->value, a->len));
+}
+
+/* Slot of the hash set of strings kept by q_delete_dup */
+typedef struct {
+    list_ele_t *e; /* Element holding the string, NULL if slot is empty */
+    uint32_t hash;
+} dup_slot_t;
+
+/*
+ * A sorted queue has equal strings next to each other, so comparing each
+ * element with the last one kept finds every duplicate in one pass.
+ * Otherwise the strings kept so far go into an open-addressing hash set
+ * with linear probing, at most half full, which each element is looked
+ * up in.  Interned strings reuse the hash of their atom.
+ */
+bool q_delete_dup(queue_t *q, bool sorted)
+{
+    if (!q)
+        return false;
+
+    dup_slot_t *set = NULL;
+    size_t cap = 16;
+    if (!sorted) {
+        while (cap < 2 * q->size)
+            cap <<= 1;
+        set = malloc(cap * sizeof(dup_slot_t));
+        if (!set)
+            return false;
+        memset(set, 0, cap * sizeof(dup_slot_t));
+    }
+
+    list_ele_t **p = &q->head;
+    list_ele_t *kept = NULL;
+    while (*p) {
+        list_ele_t *e = *p;
+        bool dup;
+        if (sorted) {
+            dup = kept && ele_equal(kept, e, q->keys);
+        } else {
+            uint32_t hash = q->store == Q_STORE_INTERN
+                                ? atom_of(e->value)->hash
+                                : hash_string(e->value, e->len + 1);
+            size_t i = hash & (cap - 1);
+            while (set[i].e &&
+                   (set[i].hash != hash || !ele_equal(set[i].e, e, q->keys)))
+                i = (i + 1) & (cap - 1);
+            dup = set[i].e != NULL;
+            if (!dup) {
+                set[i].e = e;
+                set[i].hash = hash;
+            }
+        }
+
+        if (dup) {
+            *p = e->next;
+            ele_discard(q, e);
+            q->size--;
+        } else {
+            kept = e;
+            p = &e->next;
+        }
+    }
+    q->tail = kept;
+
+    /* The holes left in the arena are reclaimed once, at the end */
+    if (q->store == Q_STORE_ARENA)
+        arena_reclaim(q);
+    free(set);
+    return true;
 }
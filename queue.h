@@ -10,25 +10,122 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 /* Data structure declarations */
 
-/* Linked list element (You shouldn't need to change this) */
+/*
+ * Linked list element
+ * Queues with sort keys lay each key out right after its element.
+ */
 typedef struct ELE {
     /* Pointer to array holding string.
      * This array needs to be explicitly allocated and freed
      */
     char *value;
     struct ELE *next;
+    size_t len; /* Length of value, not counting the null terminator */
 } list_ele_t;
 
+/* Ways of storing the string of each element */
+typedef enum {
+    Q_STORE_HEAP,   /* Pooled element, string in a separate block */
+    Q_STORE_INLINE, /* Element and string share one block */
+    Q_STORE_ARENA,  /* Pooled element, string in a per-queue arena */
+    Q_STORE_INTERN, /* Pooled element, equal strings shared and refcounted */
+} q_store_t;
+
+/* Sort keys computed for each element when it is inserted */
+typedef enum {
+    Q_KEY_NONE,   /* Always compare the strings */
+    Q_KEY_PACKED, /* Pack up to 12 lowercase letters, 5 bits each */
+    Q_KEY_PREFIX, /* First 8 bytes, big-endian */
+    Q_KEY_FOLDED, /* First 8 bytes in lower case, big-endian */
+} q_key_t;
+
+/* Algorithms q_sort can use */
+typedef enum {
+    Q_SORT_MERGE, /* Natural merge sort */
+    Q_SORT_RADIX, /* MSD radix sort over string bytes */
+    Q_SORT_ARRAY, /* Merge sort of an array of element pointers */
+} q_sort_algo_t;
+
+/* Orders q_sort_by can sort in */
+typedef enum {
+    Q_ORDER_ASCENDING,  /* Like strcmp */
+    Q_ORDER_DESCENDING, /* Like strcmp, the other way round */
+    Q_ORDER_NOCASE,     /* Like strcasecmp */
+    Q_ORDER_NATURAL,    /* Like strcmp, but numbers by their value */
+    Q_ORDER_LENGTH,     /* Shorter strings first, then like strcmp */
+} q_order_t;
+
+/* Pool slab, arena chunk, and interned string, defined in queue.c */
+struct SLAB;
+struct CHUNK;
+struct ATOM;
+
 /* Queue structure */
 typedef struct {
     list_ele_t *head; /* Linked list of elements */
     list_ele_t *tail;
     size_t size;
+    size_t bytes;    /* Resident bytes, as reported by q_footprint */
+    q_store_t store; /* How strings are stored, fixed at creation */
+    q_key_t keys;    /* Which sort keys are computed, fixed at creation */
+    /*
+     * Node pool: elements are carved out of large slabs and recycled
+     * through the free list, so inserting an element does not need a
+     * separate allocation for the list element itself.
+     */
+    struct SLAB *slabs;     /* Most recently allocated slab first */
+    list_ele_t *free_nodes; /* Recycled elements, linked through next */
+    /*
+     * String arena of Q_STORE_ARENA queues: strings are appended to
+     * chunks, and removed strings leave holes until the live strings
+     * are copied into fresh chunks.
+     */
+    struct CHUNK *chunks; /* Chunk being filled first */
+    size_t arena_live;    /* Bytes of strings still in the queue */
+    size_t arena_dead;    /* Bytes of holes left by removed strings */
+    /* Interning table of Q_STORE_INTERN queues, chained by hash */
+    struct ATOM **atoms;
+    size_t atom_buckets; /* Number of buckets, a power of 2 */
+    size_t atom_count;   /* Number of distinct strings */
 } queue_t;
 
+/*
+ * Storage strategy used by subsequent calls to q_new.
+ * Holds a q_store_t value; defaults to Q_STORE_HEAP.
+ */
+extern int q_store_mode;
+
+/*
+ * Sort keys computed by queues created by subsequent calls to q_new.
+ * Holds a q_key_t value; defaults to Q_KEY_NONE.
+ */
+extern int q_key_mode;
+
+/*
+ * Algorithm used by q_sort.
+ * Holds a q_sort_algo_t value; defaults to Q_SORT_MERGE.
+ */
+extern int q_sort_algo;
+
+/*
+ * Most threads q_sort may use.  Queues too short to give each thread
+ * a sizable share are sorted with fewer threads.  Defaults to 1.
+ * A SIGALRM arriving during a threaded sort is held back until the
+ * threads at work have been joined.
+ */
+extern int q_sort_threads;
+
+/*
+ * Comparisons made by the last call to q_sort, and how many of them
+ * could not be decided by the sort keys and had to compare the strings.
+ */
+extern size_t q_sort_compares;
+extern size_t q_sort_fallbacks;
+
 /* Operations on queue */
 
 /*
@@ -61,6 +158,22 @@ bool q_insert_head(queue_t *q, char *s);
  */
 bool q_insert_tail(queue_t *q, char *s);
 
+/*
+ * Attempt to insert the n strings of sp at head of queue, as if by calling
+ * q_insert_head on each of them in turn, so the last one ends up first.
+ * lens, if not NULL, holds the length of each string, sparing strlen.
+ * Return true if successful.
+ * Return false if q is NULL or could not allocate space, leaving the queue
+ * as it was.
+ */
+bool q_insert_head_bulk(queue_t *q, char **sp, const size_t *lens, size_t n);
+
+/*
+ * Attempt to insert the n strings of sp at tail of queue, in order.
+ * Otherwise the same as q_insert_head_bulk.
+ */
+bool q_insert_tail_bulk(queue_t *q, char **sp, const size_t *lens, size_t n);
+
 /*
  * Attempt to remove element from head of queue.
  * Return true if successful.
@@ -71,12 +184,66 @@ bool q_insert_tail(queue_t *q, char *s);
  */
 bool q_remove_head(queue_t *q, char *sp, size_t bufsize);
 
+/*
+ * Attempt to remove element from head of queue, handing its string over
+ * to the caller, who must release it with free.
+ * Return NULL if queue is NULL or empty, or could not allocate space, in
+ * which case the queue is left as it was.
+ * The string is not copied unless its storage is shared with other
+ * elements, as in Q_STORE_ARENA queues or for strings interned more than
+ * once.  The list element should be freed.
+ */
+char *q_pop_head(queue_t *q);
+
+/*
+ * Return the string at head of queue without removing it.
+ * Return NULL if queue is NULL or empty.
+ * The string still belongs to the queue, and is only valid until the
+ * queue is next changed.
+ */
+const char *q_peek_head(queue_t *q);
+
+/*
+ * Attempt to remove up to n elements from head of queue.
+ * Return the number of elements removed, 0 if q is NULL or empty.
+ * If buf is non-NULL, the removed strings are copied to it back to back,
+ * each with its null terminator, and offsets, if non-NULL, receives the
+ * offset in buf of each one.  Removal stops early at a string that does
+ * not fit in the rest of buflen bytes, unless it is the first one, which
+ * is then truncated like in q_remove_head.
+ * The space used by the list elements and the strings should be freed.
+ */
+size_t q_remove_head_bulk(queue_t *q,
+                          size_t n,
+                          char *buf,
+                          size_t buflen,
+                          size_t *offsets);
+
 /*
  * Return number of elements in queue.
  * Return 0 if q is NULL or empty
  */
 int q_size(queue_t *q);
 
+/*
+ * Return number of bytes held by queue: the queue structure, the node
+ * pool, and the string storage, including the per-block overhead of a
+ * typical malloc.
+ * Return 0 if q is NULL
+ */
+size_t q_footprint(queue_t *q);
+
+/*
+ * Move the elements of queue into one slab, laid out in list order, so
+ * that walking the list touches memory sequentially.  Strings kept in the
+ * arena are rewritten in list order as well.
+ * Return true if successful.
+ * Return false if q is NULL or could not allocate space, in which case
+ * the queue is left as it was.
+ * Has no effect on Q_STORE_INLINE queues, whose elements are not pooled.
+ */
+bool q_compact(queue_t *q);
+
 /*
  * Reverse elements in queue
  * No effect if q is NULL or empty
@@ -93,4 +260,43 @@ void q_reverse(queue_t *q);
  */
 void q_sort(queue_t *q);
 
+/*
+ * Sort elements of queue in the given order, keeping equal elements in
+ * their original order
+ * Otherwise the same as q_sort.
+ */
+void q_sort_by(queue_t *q, q_order_t order);
+
+/*
+ * Move the k smallest elements of queue to its front, in ascending order
+ * The other elements follow them in no particular order.
+ * Sorts the whole queue if k is at least its size; no effect if q is
+ * NULL or k is 0.
+ */
+void q_sort_k(queue_t *q, size_t k);
+
+/*
+ * Merge the k queues of qs, each sorted in ascending order, into qs[0]
+ * The elements are relinked, not copied, and the other queues are left
+ * empty, handing their storage over to qs[0].  Equal strings keep the
+ * order of the queues they came from.  NULL queues are skipped.
+ * Return false, changing nothing, if qs[0] is NULL or the queues differ
+ * in storage or key mode.
+ * This function does not allocate or free any memory.
+ */
+bool q_merge(queue_t **qs, int k);
+
+/*
+ * Delete every element whose string equals that of an earlier element,
+ * freeing its storage
+ * If sorted is set, the queue must have equal strings next to each other,
+ * as after q_sort, and is deduplicated in one pass.  Otherwise it may be
+ * in any order, at the cost of a temporary hash set.
+ * Apart from that set, memory is only allocated to compact the arena of
+ * a Q_STORE_ARENA queue, at most once at the end, should the holes left
+ * by deleted strings outweigh the live ones.
+ * Return false if q is NULL or the hash set could not be allocated.
+ */
+bool q_delete_dup(queue_t *q, bool sorted);
+
 #endif /* LAB0_QUEUE_H */
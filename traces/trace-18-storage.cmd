@@ -0,0 +1,64 @@
+# Test of insert_head, insert_tail, remove_head, reverse, sort, and compact with
+# inline, arena, and interned string storage
+option fail 0
+option malloc 0
+option storage 1
+new
+ih gerbil
+ih bear
+ih dolphin
+it meerkat_panda_squirrel_vulture_wolf
+it bear
+reverse
+rh bear
+rh meerkat_panda_squirrel_vulture_wolf
+sort
+rh bear
+rh dolphin
+ih RAND 1000
+it RAND 1000
+sort
+compact
+reverse
+rhq
+sort
+free
+option storage 2
+new
+ih gerbil
+ih bear
+it meerkat_panda_squirrel_vulture_wolf
+reverse
+rh meerkat_panda_squirrel_vulture_wolf
+sort
+rh bear
+rh gerbil
+ih RAND 1000
+it RAND 1000
+sort
+compact
+reverse
+rhq
+sort
+free
+option storage 3
+new
+ih gerbil 3
+it bear 2
+ih meerkat_panda_squirrel_vulture_wolf
+reverse
+rh bear
+sort
+rh bear
+rh gerbil
+rh gerbil
+rh gerbil
+rh meerkat_panda_squirrel_vulture_wolf
+ih RAND 1000
+it RAND 1000
+sort
+compact
+reverse
+rhq
+sort
+free
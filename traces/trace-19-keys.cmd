@@ -0,0 +1,75 @@
+# Test of sort with precomputed sort keys
+option fail 0
+option malloc 0
+option keys 1
+new
+ih gerbil
+ih bear
+it abcdefghijkl
+it abcdefghijklm
+it abcdefghijk
+it bear_cub
+ih RAND 1000
+sort
+free
+new
+ih dolphin
+it bear
+it gerbil
+ih gerbilgerbilgerbil
+sort
+rh bear
+rh dolphin
+rh gerbil
+rh gerbilgerbilgerbil
+free
+option keys 2
+new
+ih abcdefgh
+it abcdefghij
+it abcdefgh_
+ih abcdefg
+it abcdefghi
+ih RAND 1000
+sort
+option algo 1
+sort
+free
+new
+it abcdefghz
+ih abcdefghy
+it abc
+ih abcdefgh
+sort
+rh abc
+rh abcdefgh
+rh abcdefghy
+rh abcdefghz
+free
+option keys 3
+new
+ih RAND 1000
+it ABCDEFGHij
+it abcdefghIK
+it abcdefghi
+it ABCDEFGH
+it Zebra
+it apple
+it AB
+it ab
+it aB_
+sort nocase
+sort
+sort nocase
+free
+new
+it Zebra
+it apple
+it ABCDEFGHIJ
+it abcdefghi
+sort nocase
+rh abcdefghi
+rh ABCDEFGHIJ
+rh apple
+rh Zebra
+free
@@ -0,0 +1,55 @@
+# Test of sort with alternative algorithms and threads
+option fail 0
+option malloc 0
+option algo 1
+new
+ih RAND 5000
+it aardvark
+it aardvark_
+ih aardvark
+it zebra
+it zebra
+sort
+reverse
+sort
+free
+new
+ih gerbil
+it bear
+it dolphin
+ih bear
+sort
+rh bear
+rh bear
+rh dolphin
+rh gerbil
+free
+option threads 4
+new
+ih RAND 150000
+it aardvark 1000
+sort
+option algo 0
+reverse
+sort
+free
+option algo 2
+new
+ih RAND 150000
+it aardvark 1000
+sort
+reverse
+sort
+free
+option threads 1
+new
+ih RAND 3000
+ih gerbil 20
+sort
+option malloc 50
+reverse
+sort
+reverse
+sort
+option malloc 0
+free
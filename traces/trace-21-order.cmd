@@ -0,0 +1,59 @@
+# Test of sort in each supported order
+option fail 0
+option malloc 0
+new
+ih RAND 2000
+it file10
+it file9
+it File9
+it file009
+it Zebra
+it zebra
+it aardvark
+it AB
+it ab
+sort descend
+sort nocase
+sort natural
+sort length
+sort ascend
+reverse
+sort length
+free
+new
+it file10
+it x
+it file9
+it file009
+sort natural
+rh file9
+rh file009
+rh file10
+rh x
+it bear
+it gerbil
+it dolphin
+it cat
+sort length
+rh cat
+rh bear
+rh gerbil
+rh dolphin
+ih Bear
+ih bear
+ih ant
+sort descend
+rh bear
+rh ant
+rh Bear
+free
+option algo 2
+new
+ih RAND 2000
+it file10
+it File9
+it file009
+sort natural
+sort nocase
+sort descend
+free
@@ -0,0 +1,40 @@
+# Test performance of partial sort against full sort
+option fail 0
+option malloc 0
+new
+ih RAND 300000
+time sortk 10
+free
+new
+ih RAND 300000
+time sortk 1000
+free
+new
+ih RAND 300000
+time sortk 100000
+free
+new
+ih RAND 300000
+time sort
+free
+new
+ih RAND 300000
+time sort
+reverse
+time sortk 1000
+free
+new
+ih gerbil
+ih bear
+it dolphin
+it bear
+sortk 0
+rh bear
+ih bear
+sortk 2
+rh bear
+rh bear
+sortk 5
+rh dolphin
+rh gerbil
+free
@@ -0,0 +1,48 @@
+# Test of merging sorted queues
+option fail 0
+option malloc 0
+new
+ih RAND 20000
+it dolphin 100
+merge 1
+merge 2
+merge 16
+it bear
+ih zebra
+merge 5
+free
+option storage 2
+new
+ih RAND 5000
+it gerbil 10
+merge 7
+free
+option storage 3
+new
+ih RAND 5000
+it gerbil 10
+merge 7
+merge 3
+free
+option storage 1
+new
+ih dolphin
+it bear
+it gerbil
+merge 2
+rh bear
+rh dolphin
+rh gerbil
+merge 3
+option storage 2
+option keys 2
+it gerbil
+it bear
+merge 3
+size
+rh bear
+rh gerbil
+option storage 0
+option keys 0
+free
+merge 2
@@ -0,0 +1,13 @@
+# Test of searching for slow inputs
+option fail 0
+option malloc 0
+search sort 500 50
+search reverse 200 20
+search ops 200 20
+option keys 2
+search sort 500 50
+new
+ih dolphin
+search sort 1 5
+rh dolphin
+free
@@ -0,0 +1,32 @@
+# Test performance of deleting duplicates, sorted and unsorted
+option fail 0
+option malloc 0
+option duplicates 30
+new
+ih RAND 1000000
+dedup
+free
+new
+ih RAND 300000
+sort
+dedup sorted
+free
+option duplicates 0
+new
+ih gerbil
+ih bear
+it gerbil
+it dolphin
+it bear
+dedup
+rh bear
+rh gerbil
+rh dolphin
+ih bear
+it bear
+it cat
+it cat
+dedup sorted
+rh bear
+rh cat
+free
@@ -0,0 +1,41 @@
+# Test of bulk insertion, including storage modes and malloc failure
+option fail 10
+option malloc 0
+option bulk 1
+new
+ih dolphin 100
+it gerbil 100
+rh dolphin
+size
+option storage 1
+new
+it bear 40
+ih RAND 40
+size
+option storage 2
+new
+ih RAND 50
+it meerkat 50
+size
+option storage 3
+new
+ih cat 60
+it cat 60
+size
+option malloc 10
+option storage 0
+new
+ih dolphin 100
+it gerbil 100
+option storage 2
+new
+ih RAND 100
+it meerkat 100
+option malloc 0
+free
+option fail 0
+option storage 0
+new
+time ih RAND 2000000
+time it gerbil 2000000
+free
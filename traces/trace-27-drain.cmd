@@ -0,0 +1,44 @@
+# Test of bulk removal, including storage modes and draining big queues
+option fail 10
+option malloc 0
+new
+ih dolphin 40
+ih bear 40
+rh bear 40
+rh dolphin 39
+rh dolphin
+size
+rhq
+ih gerbil 10
+it meerkat 10
+rhq 10
+rh meerkat 10
+size
+option storage 1
+new
+it bear 50
+rhq 25
+rh bear 25
+option storage 2
+new
+ih cat 5000
+it meerkat_panda_squirrel_vulture_wolf 3000
+rh cat 5000
+rhq 2999
+rh meerkat_panda_squirrel_vulture_wolf
+option storage 3
+new
+ih cat 60
+it bear 60
+rh cat 60
+rhq 60
+size
+option storage 0
+option fail 0
+new
+ih RAND 1000000
+it dolphin 1000000
+time rhq 1000000
+time rh dolphin 1000000
+size
+free
@@ -0,0 +1,58 @@
+# Test of popping and peeking at head, in every storage mode
+option fail 10
+option malloc 0
+peek
+pop
+new
+peek
+pop
+ih dolphin
+ih bear
+it gerbil
+peek bear
+pop bear
+peek dolphin
+pop dolphin
+pop gerbil
+peek
+option storage 1
+new
+ih meerkat_panda_squirrel_vulture_wolf
+it cat
+peek meerkat_panda_squirrel_vulture_wolf
+pop meerkat_panda_squirrel_vulture_wolf
+pop cat
+option storage 2
+new
+ih bear 3
+it dolphin
+pop bear
+peek bear
+pop bear
+pop bear
+pop dolphin
+option storage 3
+new
+ih gerbil 3
+it meerkat
+pop gerbil
+pop gerbil
+peek gerbil
+pop gerbil
+pop meerkat
+ih cat
+option storage 2
+new
+option fail 30
+option malloc 25
+ih bear 20
+pop
+pop
+pop
+pop
+pop
+pop
+pop
+pop
+option malloc 0
+free